@@ -1,16 +1,78 @@
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "client.h"
+#include "stats.h"
 
 #define AMPLIFICATION 20
 
+/* How the surface content is moved around at each frame:
+ * - attach: repaint and attach a new buffer along with the delta
+ * - offset: only send wl_surface.offset, without attaching any buffer
+ * - static: re-attach the same buffer along with the delta, without
+ *   repainting nor damaging it */
+enum move_mode {
+	MOVE_ATTACH,
+	MOVE_OFFSET,
+	MOVE_STATIC,
+};
+
+static enum move_mode mode = MOVE_ATTACH;
 double scale = 20;
 double cnt = 0.0;
 static struct wleird_toplevel toplevel = {0};
 static const struct wl_callback_listener callback_listener;
 
+static struct {
+	pid_t compositor_pid;
+	uint64_t compositor_cpu_time;
+	uint64_t last_report;
+	uint64_t attach_time[2];
+	int frames;
+	struct latency_stats release_latency;
+} stats = {0};
+
+static void buffer_handle_release(struct pool_buffer *buffer, void *data) {
+	size_t i = buffer - toplevel.surface.buffers;
+	if (i < 2 && stats.attach_time[i] != 0) {
+		latency_stats_add(&stats.release_latency,
+			get_time_ns() - stats.attach_time[i]);
+		stats.attach_time[i] = 0;
+	}
+}
+
+static void record_attach(void) {
+	for (size_t i = 0; i < 2; i++) {
+		if (toplevel.surface.buffers[i].busy && stats.attach_time[i] == 0) {
+			stats.attach_time[i] = get_time_ns();
+		}
+	}
+}
+
+static void report(void) {
+	uint64_t now = get_time_ns();
+	if (now - stats.last_report < 1000000000) {
+		return;
+	}
+
+	uint64_t cpu_time = get_process_cpu_time(stats.compositor_pid);
+	double elapsed = (now - stats.last_report) / 1e9;
+	double cpu_us = (cpu_time - stats.compositor_cpu_time) / 1e3;
+	fprintf(stderr, "frames=%.1f/s compositor-cpu=%.1fms/s per-frame=%.1fus\n",
+		stats.frames / elapsed, cpu_us / 1000 / elapsed,
+		stats.frames > 0 ? cpu_us / stats.frames : 0.0);
+	if (mode != MOVE_OFFSET) {
+		latency_stats_print(&stats.release_latency, "attach to release");
+	}
+
+	stats.last_report = now;
+	stats.compositor_cpu_time = cpu_time;
+	stats.frames = 0;
+	latency_stats_reset(&stats.release_latency);
+}
+
 static void request_frame_callback(void) {
 	struct wl_callback *callback = wl_surface_frame(toplevel.surface.wl_surface);
 	wl_callback_add_listener(callback, &callback_listener, NULL);
@@ -23,11 +85,40 @@ static void callback_handle_done(void *data, struct wl_callback *callback,
 		wl_callback_destroy(callback);
 	}
 
-	toplevel.surface.attach_x = sin(cnt) * scale;
-	toplevel.surface.attach_y = cos(cnt) * scale;
-	surface_render(&toplevel.surface);
+	struct wleird_surface *surface = &toplevel.surface;
+	surface->attach_x = sin(cnt) * scale;
+	surface->attach_y = cos(cnt) * scale;
+
+	switch (mode) {
+	case MOVE_ATTACH:
+		surface_render(surface);
+		record_attach();
+		break;
+	case MOVE_OFFSET:
+		wl_surface_offset(surface->wl_surface,
+			surface->attach_x, surface->attach_y);
+		surface->attach_x = surface->attach_y = 0;
+		break;
+	case MOVE_STATIC:;
+		// The last rendered buffer is the one with the latest content
+		struct pool_buffer *buffer = NULL;
+		for (size_t i = 0; i < 2; i++) {
+			if (surface->buffers[i].buffer != NULL) {
+				buffer = &surface->buffers[i];
+			}
+		}
+		if (buffer != NULL) {
+			surface_attach(surface, buffer);
+			buffer->busy = true;
+			record_attach();
+		}
+		surface->attach_x = surface->attach_y = 0;
+		break;
+	}
 
 	cnt += 0.1;
+	stats.frames++;
+	report();
 	request_frame_callback();
 }
 
@@ -46,12 +137,32 @@ static void xdg_toplevel_handle_configure(void *data,
 	toplevel.surface.height = 100;
 }
 
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [scale] [attach|offset|static]\n", bin);
+	fprintf(stderr, "attach: repaint and attach a new buffer (default)\n");
+	fprintf(stderr, "offset: only send wl_surface.offset\n");
+	fprintf(stderr, "static: re-attach the same buffer, without damage\n");
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
+	if (argc > 3) {
+		return usage(argv[0]);
+	}
 	if (argc > 1) {
 		scale = strtof(argv[1], NULL);
 		if (scale <= 0.0) {
 			fprintf(stderr, "invalid scale argument\n");
-			return EXIT_FAILURE;
+			return usage(argv[0]);
+		}
+	}
+	if (argc > 2) {
+		if (strcmp(argv[2], "offset") == 0) {
+			mode = MOVE_OFFSET;
+		} else if (strcmp(argv[2], "static") == 0) {
+			mode = MOVE_STATIC;
+		} else if (strcmp(argv[2], "attach") != 0) {
+			return usage(argv[0]);
 		}
 	}
 
@@ -65,10 +176,23 @@ int main(int argc, char *argv[]) {
 
 	registry_init(display);
 	toplevel_init(&toplevel);
+	for (size_t i = 0; i < 2; i++) {
+		toplevel.surface.buffers[i].release = buffer_handle_release;
+	}
+
+	if (mode == MOVE_OFFSET && wl_surface_get_version(
+			toplevel.surface.wl_surface) < WL_SURFACE_OFFSET_SINCE_VERSION) {
+		fprintf(stderr, "compositor doesn't support wl_surface.offset\n");
+		return EXIT_FAILURE;
+	}
 
 	float color[4] = {1, 0, 0, 1};
 	memcpy(toplevel.surface.color, color, sizeof(float[4]));
 
+	stats.compositor_pid = get_compositor_pid(display);
+	stats.compositor_cpu_time = get_process_cpu_time(stats.compositor_pid);
+	stats.last_report = get_time_ns();
+
 	request_frame_callback();
 
 	while (wl_display_dispatch(display) != -1) {
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,22 +12,155 @@ struct wl_shm *shm = NULL;
 struct wl_compositor *compositor = NULL;
 struct xdg_wm_base *wm_base = NULL;
 struct wl_data_device_manager *data_device_manager = NULL;
+struct wp_presentation *presentation = NULL;
+uint32_t presentation_clock_id = 0;
+struct wp_viewporter *viewporter = NULL;
+struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager = NULL;
 
 struct wl_seat *seat = NULL;
 struct wl_pointer *pointer = NULL;
 
+bool opaque_regions = true;
+
 static struct zxdg_decoration_manager_v1 *decoration_manager = NULL;
 
 void noop() {
 	// This space is intentionally left blank
 }
 
-void surface_render(struct wleird_surface *surface) {
+static void surface_attach_buffer(struct wleird_surface *surface,
+		struct wl_buffer *buffer) {
+	// Since version 5, the attach offset must be set with wl_surface.offset
+	if (wl_surface_get_version(surface->wl_surface) >=
+			WL_SURFACE_OFFSET_SINCE_VERSION) {
+		if (surface->attach_x != 0 || surface->attach_y != 0) {
+			wl_surface_offset(surface->wl_surface,
+				surface->attach_x, surface->attach_y);
+		}
+		wl_surface_attach(surface->wl_surface, buffer, 0, 0);
+	} else {
+		wl_surface_attach(surface->wl_surface, buffer,
+			surface->attach_x, surface->attach_y);
+	}
+}
+
+void surface_attach(struct wleird_surface *surface,
+		struct pool_buffer *buffer) {
+	surface_attach_buffer(surface, buffer->buffer);
+}
+
+static void surface_update_opaque_region(struct wleird_surface *surface) {
+	bool opaque = false;
+	switch (surface->opaque) {
+	case WLEIRD_OPAQUE_AUTO:
+		opaque = surface->color[3] >= 1.0;
+		break;
+	case WLEIRD_OPAQUE_NEVER:
+		break;
+	case WLEIRD_OPAQUE_ALWAYS:
+		opaque = true;
+		break;
+	}
+	opaque = opaque && opaque_regions;
+	if (opaque == surface->opaque_region) {
+		return;
+	}
+
+	struct wl_region *region = NULL;
+	if (opaque) {
+		// The compositor clips the region to the surface, so it doesn't need
+		// to be updated on resize
+		region = wl_compositor_create_region(compositor);
+		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+	}
+	wl_surface_set_opaque_region(surface->wl_surface, region);
+	if (region != NULL) {
+		wl_region_destroy(region);
+	}
+	surface->opaque_region = opaque;
+}
+
+static void single_pixel_buffer_handle_release(void *data,
+		struct wl_buffer *wl_buffer) {
+	struct single_pixel_buffer *buffer = data;
+	buffer->busy = false;
+}
+
+static const struct wl_buffer_listener single_pixel_buffer_listener = {
+	.release = single_pixel_buffer_handle_release,
+};
+
+static uint32_t color_to_u32(float value, float alpha) {
+	// Single-pixel buffers are premultiplied
+	return (uint32_t)((double)value * alpha * UINT32_MAX);
+}
+
+static struct single_pixel_buffer *get_single_pixel_buffer(
+		struct wleird_surface *surface) {
+	struct single_pixel_buffer *free_buffer = NULL;
+	for (size_t i = 0; i < 2; i++) {
+		struct single_pixel_buffer *buffer = &surface->single_pixel_buffers[i];
+		if (buffer->buffer != NULL && memcmp(buffer->color, surface->color,
+				sizeof(buffer->color)) == 0) {
+			// Single-pixel buffers never change, so they can be attached
+			// again even if the compositor still holds them
+			return buffer;
+		}
+		if (!buffer->busy && free_buffer == NULL) {
+			free_buffer = buffer;
+		}
+	}
+	if (free_buffer == NULL) {
+		return NULL;
+	}
+
+	if (free_buffer->buffer != NULL) {
+		wl_buffer_destroy(free_buffer->buffer);
+	}
+	float *color = surface->color;
+	free_buffer->buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+		single_pixel_buffer_manager, color_to_u32(color[0], color[3]),
+		color_to_u32(color[1], color[3]), color_to_u32(color[2], color[3]),
+		color_to_u32(color[3], 1));
+	wl_buffer_add_listener(free_buffer->buffer, &single_pixel_buffer_listener,
+		free_buffer);
+	memcpy(free_buffer->color, color, sizeof(free_buffer->color));
+	return free_buffer;
+}
+
+static bool surface_render_single_pixel(struct wleird_surface *surface) {
+	struct single_pixel_buffer *buffer = get_single_pixel_buffer(surface);
+	if (buffer == NULL) {
+		fprintf(stderr, "failed to obtain buffer\n");
+		return false;
+	}
+
+	if (surface->viewport == NULL) {
+		surface->viewport =
+			wp_viewporter_get_viewport(viewporter, surface->wl_surface);
+	}
+	wp_viewport_set_destination(surface->viewport,
+		surface->width, surface->height);
+
+	surface_attach_buffer(surface, buffer->buffer);
+	wl_surface_damage_buffer(surface->wl_surface, 0, 0, 1, 1);
+	surface_update_opaque_region(surface);
+	wl_surface_commit(surface->wl_surface);
+	buffer->busy = true;
+	surface->attach_x = surface->attach_y = 0;
+	return true;
+}
+
+bool surface_render(struct wleird_surface *surface) {
+	if (surface->single_pixel) {
+		return surface_render_single_pixel(surface);
+	}
+
 	struct pool_buffer *buffer = get_next_buffer(shm, surface->buffers,
 		surface->width, surface->height);
 	if (buffer == NULL) {
 		fprintf(stderr, "failed to obtain buffer\n");
-		return;
+		return false;
 	}
 
 	cairo_t *cairo = buffer->cairo;
@@ -37,19 +172,21 @@ void surface_render(struct wleird_surface *surface) {
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 
-	wl_surface_attach(surface->wl_surface, buffer->buffer,
-		surface->attach_x, surface->attach_y);
+	surface_attach(surface, buffer);
 	wl_surface_damage_buffer(surface->wl_surface, 0, 0,
 		surface->width, surface->height);
+	surface_update_opaque_region(surface);
 	wl_surface_commit(surface->wl_surface);
 	buffer->busy = true;
 	surface->attach_x = surface->attach_y = 0;
+	return true;
 }
 
 void surface_init(struct wleird_surface *surface) {
 	surface->wl_surface = wl_compositor_create_surface(compositor);
 	surface->width = 300;
 	surface->height = 400;
+	surface->opaque_region = false;
 }
 
 
@@ -134,6 +271,15 @@ static const struct xdg_wm_base_listener wm_base_listener = {
 	.ping = wm_base_handle_ping,
 };
 
+static void presentation_handle_clock_id(void *data,
+		struct wp_presentation *wp_presentation, uint32_t clk_id) {
+	presentation_clock_id = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_handle_clock_id,
+};
+
 
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
@@ -141,7 +287,7 @@ static void handle_global(void *data, struct wl_registry *registry,
 		shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
 	} else if (strcmp(interface, wl_compositor_interface.name) == 0) {
 		compositor = wl_registry_bind(registry, name,
-			&wl_compositor_interface, 4);
+			&wl_compositor_interface, version >= 5 ? 5 : 4);
 	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
 		wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
 		xdg_wm_base_add_listener(wm_base, &wm_base_listener, NULL);
@@ -151,6 +297,18 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wl_data_device_manager_interface.name) == 0) {
 		data_device_manager = wl_registry_bind(registry, name,
 			&wl_data_device_manager_interface, 3);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		presentation = wl_registry_bind(registry, name,
+			&wp_presentation_interface, 1);
+		wp_presentation_add_listener(presentation, &presentation_listener,
+			NULL);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		viewporter = wl_registry_bind(registry, name,
+			&wp_viewporter_interface, 1);
+	} else if (strcmp(interface,
+			wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		single_pixel_buffer_manager = wl_registry_bind(registry, name,
+			&wp_single_pixel_buffer_manager_v1_interface, 1);
 	} else if (strcmp(interface, zxdg_decoration_manager_v1_interface.name) == 0) {
 		decoration_manager = wl_registry_bind(registry, name,
 			&zxdg_decoration_manager_v1_interface, 1);
@@ -167,7 +325,28 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = handle_global_remove,
 };
 
+bool display_flush_blocking(struct wl_display *display) {
+	while (wl_display_flush(display) == -1) {
+		if (errno != EAGAIN) {
+			return false;
+		}
+		struct pollfd pfd = {
+			.fd = wl_display_get_fd(display),
+			.events = POLLOUT,
+		};
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
 void registry_init(struct wl_display *display) {
+	const char *opaque_env = getenv("WLEIRD_OPAQUE");
+	if (opaque_env != NULL && strcmp(opaque_env, "0") == 0) {
+		opaque_regions = false;
+	}
+
 	struct wl_registry *registry = wl_display_get_registry(display);
 	wl_registry_add_listener(registry, &registry_listener, NULL);
 	wl_display_dispatch(display);
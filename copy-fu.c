@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include "client.h"
 
 #include <errno.h>
@@ -7,13 +7,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "stats.h"
+
+#ifdef HAVE_EXT_DATA_CONTROL
+#include "ext-data-control-v1-client-protocol.h"
+#endif
+
+#define TRANSFER_SLAB_SIZE 256
+#define MAX_EVENTS 64
+#define RECV_FLOOD_COUNT 4000
+#define RECV_FLOOD_BATCH 100
+#define PATTERN_PIPE_SIZE (1 << 20)
+#define DEFAULT_PAYLOAD "pattern:256M"
+#define OFFER_FLOOD_COUNT 50000
+#define OFFER_FLOOD_BATCH 1000
+#define OFFER_TABLE_MIN_BUCKETS 64
+#define CHURN_OWNERS 4
+#define CHURN_RECEIVERS 4
+#define CHURN_RATE 10
+#define CHURN_MIMETYPE "application/x-wleird-churn;t="
+
 enum copyfu_mode {
 	DEFAULT, CAT_RANDOM, BAD_SERIAL, ZERO_SINK, STEAL_SERIAL, RECV_FILE,
-	STEAL_SYNC, RECV_FLOOD, RECV_SOCKETPAIR, RECV_EPIPE
+	STEAL_SYNC, RECV_FLOOD, RECV_SOCKETPAIR, RECV_EPIPE, SPLICE_SOURCE,
+	SPLICE_SINK, STREAM_SOURCE, OFFER_FLOOD, DND, CHURN
 };
 
 struct cli_option {
@@ -25,13 +51,38 @@ struct cli_option {
 enum send_type {
 	SEND_NOT,
 	SEND_TEXT,
-	SEND_OCTET_STREAM
+	SEND_OCTET_STREAM,
+	SEND_PAYLOAD,
+	SEND_STREAM
 };
 
 enum recv_type {
 	RECV_NOT,
 	RECV_TEXT,
-	RECV_OCTET_STREAM
+	RECV_OCTET_STREAM,
+	RECV_SPLICE
+};
+
+enum payload_kind {
+	PAYLOAD_FILE,
+	PAYLOAD_PATTERN,
+	PAYLOAD_MEMFD
+};
+
+/* The payload sent in splice-source mode never goes through userspace: files
+ * and memfds are sent with sendfile, and a generated pattern is kept in a
+ * pipe and duplicated into the destination with tee. tee only writes to
+ * pipes, so for other destinations the pattern goes through a relay pipe and
+ * is spliced from there. stream-source writes the same payload from a
+ * mapping instead. */
+struct payload {
+	enum payload_kind kind;
+	int fd; // the read end of the pipe for patterns
+	off_t size;
+	/* the whole file or memfd, or a single pattern chunk repeated over
+	 * and over */
+	char *data;
+	size_t data_len;
 };
 
 enum sync_steal_state {
@@ -40,25 +91,58 @@ enum sync_steal_state {
 	SYNC_STEAL_DONE
 };
 
-struct fd_extra {
+struct transfer {
+	int fd;
 	enum send_type send_type;
 	enum recv_type recv_type;
 	int refcount;
 	int write_counter, read_counter;
+	off_t offset;
+	/* time to first byte and time spent waiting for the peer after a
+	 * short write or EAGAIN, which is where backpressure shows up */
+	uint64_t start_time, first_byte_time;
+	uint64_t stall_start, stall_time;
+	/* relay pipe for patterns sent to something else than a pipe, and the
+	 * number of bytes waiting in it */
+	int relay[2];
+	size_t relayed;
+	struct transfer *next_free;
+	/* regular files can't be registered to epoll, and are always ready */
+	bool always_ready;
+	struct transfer *next_ready;
 };
 
-struct fd_queue {
-	int nfds;
-	/* The first fd to be polled is always the main event loop */
-	struct pollfd *pfds;
-	struct fd_extra *meta;
+/* Transfers are registered to epoll, so that each wakeup only costs as much
+ * as the number of ready transfers. Transfer records are allocated in slabs
+ * which never move, since epoll events point to them, and recycled through a
+ * free list. Transfers on fds epoll refuses are kept on a separate list, and
+ * handled on every iteration. */
+struct transfer_table {
+	int epoll_fd;
+	struct transfer **slabs;
+	size_t nslabs;
+	struct transfer *free_list;
+	struct transfer *ready_list;
+	int active, completed;
 };
 
 struct mimetype_offer {
 	struct wl_list link;
+	struct mimetype_offer *next_in_bucket;
+	uint32_t hash;
 	char *val;
 };
 
+/* Mime types of the current offer, most recent first, and
+ * hashed to detect duplicates without walking the whole list */
+struct offer_table {
+	struct wl_list list;
+	struct mimetype_offer **buckets;
+	size_t nbuckets, len;
+	int duplicates;
+	uint64_t handling_time;
+};
+
 static const struct cli_option cli_options[] = {
 	{DEFAULT, "default", "Receive on kbd focus enter, copy on click"},
 	{CAT_RANDOM, "cat-rand", "On click, offer /dev/urandom as text/plain"},
@@ -67,9 +151,15 @@ static const struct cli_option cli_options[] = {
 	{ZERO_SINK, "zero-sink", "Receive to /dev/null"},
 	{RECV_FILE, "recv-file", "Receive to paste_result.txt"},
 	{STEAL_SYNC, "steal-sync", "Periodically try the wl_display::sync serial"},
-	{RECV_FLOOD, "recv-flood", "Receive very many times to /dev/null"},
+	{RECV_FLOOD, "recv-flood", "Receive very many times concurrently"},
 	{RECV_SOCKETPAIR, "recv-sockpair", "Receive to a socketpair"},
-	{RECV_EPIPE, "recv-epipe", "Receive to a readerless pipe"}
+	{RECV_EPIPE, "recv-epipe", "Receive to a readerless pipe"},
+	{SPLICE_SOURCE, "splice-source", "On click, offer a payload sent without copies"},
+	{SPLICE_SINK, "splice-sink", "Receive to /dev/null without copies"},
+	{STREAM_SOURCE, "stream-source", "On click, offer a payload sent with non-blocking writes"},
+	{OFFER_FLOOD, "offer-flood", "On click, offer very many mime types"},
+	{DND, "dnd", "On click, drag a payload, and receive drops (drag by hand)"},
+	{CHURN, "churn", "Fork selection owners and receivers, with ext-data-control if available"}
 };
 
 static enum copyfu_mode mode = DEFAULT;
@@ -79,53 +169,527 @@ static struct wl_data_source *data_source = NULL;
 static struct wl_data_offer *data_offer = NULL;
 static struct wl_display *display = NULL;
 static int devnull = -1;
+static int urandom = -1;
 static uint32_t last_serial = 0;
 
-static struct wl_list offer_list = {&offer_list, &offer_list};
-static struct fd_queue fd_set = {0};
+static struct offer_table offers = {0};
+static int offer_flood_count = OFFER_FLOOD_COUNT;
+static uint64_t offer_flood_start = 0;
+static pid_t compositor_pid = -1;
+
+/* In dnd mode, copy-fu is both the drag source and the drop target, so that
+ * the whole drag can be driven by moving the pointer around its window.
+ * Nothing moves the pointer for you: drags have to be done by hand. */
+static struct {
+	struct wl_data_offer *offer;
+	uint64_t last_report;
+	int enters, leaves, motions;
+	uint64_t drop_time;
+	struct latency_stats finish_latency;
+} dnd = {0};
+
+/* In churn mode, the parent forks owners, which set the selection at a fixed
+ * rate, and receivers, which receive every selection they get. The time at
+ * which the selection was set travels in one of the mime types.
+ *
+ * wl_data_device only sends selections to the client with keyboard focus,
+ * and only lets it set the selection with a recent input serial. The churn
+ * uses ext-data-control instead, like clipboard managers do, which needs
+ * neither. Without it, receivers that never get a selection say so instead
+ * of reporting numbers. */
+enum churn_role {
+	CHURN_PARENT,
+	CHURN_OWNER,
+	CHURN_RECEIVER
+};
+
+static struct {
+	enum churn_role role;
+	int index;
+	int owners, receivers, rate;
+	uint64_t next_tick, last_report;
+	bool sync_pending;
+	int selections;
+	struct latency_stats delivery_latency;
+	bool data_control;
+#ifdef HAVE_EXT_DATA_CONTROL
+	struct ext_data_control_manager_v1 *manager;
+	struct ext_data_control_device_v1 *device;
+	struct ext_data_control_offer_v1 *selection;
+#endif
+} churn = { .owners = CHURN_OWNERS, .receivers = CHURN_RECEIVERS,
+	.rate = CHURN_RATE };
+static uint64_t compositor_rss = 0;
+static struct transfer_table transfers = { .epoll_fd = -1 };
+static uint64_t flood_start = 0;
+static struct payload payload = { .fd = -1 };
 static const struct wl_data_source_listener data_source_listener;
 static const struct wl_data_offer_listener data_offer_listener;
 static enum sync_steal_state steal_state = SYNC_STEAL_READY;
 
-static void add_set_fd(int fd, enum send_type stype, enum recv_type rtype) {
-	int idx =fd_set.nfds++;
-	fd_set.pfds = realloc(fd_set.pfds, fd_set.nfds * sizeof(struct pollfd));
-	fd_set.meta = realloc(fd_set.meta, fd_set.nfds * sizeof(struct fd_extra));
-
-	fd_set.pfds[idx].fd = fd;
-	fd_set.pfds[idx].events = (stype == SEND_NOT ? 0 : POLLOUT) | (rtype == RECV_NOT ? 0 : POLLIN);
-	fd_set.meta[idx].send_type = stype;
-	fd_set.meta[idx].recv_type = rtype;
-	fd_set.meta[idx].refcount = (stype != SEND_NOT) + (rtype != RECV_NOT);
-	fd_set.meta[idx].write_counter = 0;
-	fd_set.meta[idx].read_counter = 0;
-}
-
-static void remove_done_fds(void) {
-	int iw = 0;
-	for (int ir=0;ir<fd_set.nfds;ir++) {
-		if (fd_set.meta[ir].refcount > 0) {
-			fd_set.meta[iw] = fd_set.meta[ir];
-			fd_set.pfds[iw] = fd_set.pfds[ir];
-			iw++;
+static struct transfer *alloc_transfer(void) {
+	if (transfers.free_list == NULL) {
+		struct transfer *slab =
+			calloc(TRANSFER_SLAB_SIZE, sizeof(struct transfer));
+		struct transfer **slabs = realloc(transfers.slabs,
+			(transfers.nslabs + 1) * sizeof(struct transfer *));
+		if (slab == NULL || slabs == NULL) {
+			free(slab);
+			return NULL;
+		}
+		transfers.slabs = slabs;
+		transfers.slabs[transfers.nslabs++] = slab;
+
+		for (size_t i = 0; i < TRANSFER_SLAB_SIZE; i++) {
+			slab[i].next_free = transfers.free_list;
+			transfers.free_list = &slab[i];
+		}
+	}
+
+	struct transfer *transfer = transfers.free_list;
+	transfers.free_list = transfer->next_free;
+	return transfer;
+}
+
+static void add_transfer(int fd, enum send_type stype, enum recv_type rtype) {
+	struct transfer *transfer = alloc_transfer();
+	if (transfer == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		close(fd);
+		return;
+	}
+
+	transfer->fd = fd;
+	transfer->send_type = stype;
+	transfer->recv_type = rtype;
+	transfer->refcount = (stype != SEND_NOT) + (rtype != RECV_NOT);
+	transfer->write_counter = 0;
+	transfer->read_counter = 0;
+	transfer->offset = 0;
+	transfer->start_time = get_time_ns();
+	transfer->first_byte_time = 0;
+	transfer->stall_start = transfer->stall_time = 0;
+	transfer->next_free = NULL;
+	transfer->always_ready = false;
+	transfer->next_ready = NULL;
+	transfer->relay[0] = transfer->relay[1] = -1;
+	transfer->relayed = 0;
+
+	struct stat st;
+	if (stype == SEND_PAYLOAD && payload.kind == PAYLOAD_PATTERN &&
+			fstat(fd, &st) == 0 && !S_ISFIFO(st.st_mode)) {
+		if (pipe2(transfer->relay, O_CLOEXEC | O_NONBLOCK) == -1) {
+			fprintf(stderr, "failed to create relay pipe: %s\n",
+				strerror(errno));
+			transfer->relay[0] = transfer->relay[1] = -1;
 		} else {
-			/* no more references, can close the fd */
-			close(fd_set.pfds[ir].fd);
+			fcntl(transfer->relay[1], F_SETPIPE_SZ, PATTERN_PIPE_SIZE);
+		}
+	}
+
+	struct epoll_event ev = {
+		.events = (stype == SEND_NOT ? 0 : EPOLLOUT) |
+			(rtype == RECV_NOT ? 0 : EPOLLIN),
+		.data.ptr = transfer,
+	};
+	if (epoll_ctl(transfers.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		if (errno == EPERM) {
+			transfer->always_ready = true;
+			transfer->next_ready = transfers.ready_list;
+			transfers.ready_list = transfer;
+			transfers.active++;
+			return;
 		}
+		fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+		close(fd);
+		transfer->next_free = transfers.free_list;
+		transfers.free_list = transfer;
+		return;
+	}
+	transfers.active++;
+}
+
+static void dnd_transfer_done(void);
+
+static void release_transfer(struct transfer *transfer) {
+	if (mode == DND && transfer->recv_type != RECV_NOT) {
+		dnd_transfer_done();
+	}
+
+	/* no more references, can close the fd */
+	if (transfer->always_ready) {
+		struct transfer **link = &transfers.ready_list;
+		while (*link != transfer) {
+			link = &(*link)->next_ready;
+		}
+		*link = transfer->next_ready;
+	} else {
+		epoll_ctl(transfers.epoll_fd, EPOLL_CTL_DEL, transfer->fd, NULL);
+	}
+	close(transfer->fd);
+	if (transfer->relay[0] != -1) {
+		close(transfer->relay[0]);
+		close(transfer->relay[1]);
 	}
-	if (iw < fd_set.nfds) {
-		fd_set.nfds = iw;
+	transfer->next_free = transfers.free_list;
+	transfers.free_list = transfer;
+	transfers.active--;
+	transfers.completed++;
+
+	if (mode == RECV_FLOOD && transfers.active == 0) {
+		double elapsed = (get_time_ns() - flood_start) / 1e9;
+		printf("Completed %d transfers in %.1fms (%.0f transfers/s)\n",
+			transfers.completed, elapsed * 1000,
+			transfers.completed / elapsed);
+		transfers.completed = 0;
+	}
+}
+
+/* Accounts for the result of a non-blocking read or write of n bytes */
+static void transfer_progress(struct transfer *transfer, ssize_t n) {
+	uint64_t now = get_time_ns();
+	if (n > 0) {
+		if (transfer->first_byte_time == 0) {
+			transfer->first_byte_time = now;
+		}
+		if (transfer->stall_start != 0) {
+			transfer->stall_time += now - transfer->stall_start;
+			transfer->stall_start = 0;
+		}
+	} else if (n < 0 && errno == EAGAIN && transfer->stall_start == 0) {
+		transfer->stall_start = now;
+	}
+}
+
+static void print_throughput(const char *verb, struct transfer *transfer) {
+	uint64_t now = get_time_ns();
+	double elapsed = (now - transfer->start_time) / 1e9;
+	double ttfb = transfer->first_byte_time == 0 ? 0 :
+		(transfer->first_byte_time - transfer->start_time) / 1e6;
+	printf("%s %lld bytes with fd=%d in %.1fms (%.1f MB/s), "
+		"first byte after %.3fms, stalled for %.1fms\n", verb,
+		(long long)transfer->offset, transfer->fd, elapsed * 1000,
+		transfer->offset / elapsed / 1e6, ttfb,
+		transfer->stall_time / 1e6);
+}
+
+static off_t parse_size(const char *str) {
+	char *end;
+	long long size = strtoll(str, &end, 10);
+	switch (*end) {
+	case 'G':
+		size *= 1024;
+		/* fallthrough */
+	case 'M':
+		size *= 1024;
+		/* fallthrough */
+	case 'K':
+		size *= 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		return -1;
 	}
-	fd_set.pfds = realloc(fd_set.pfds, fd_set.nfds * sizeof(struct pollfd));
-	fd_set.meta = realloc(fd_set.meta, fd_set.nfds * sizeof(struct fd_extra));
+	return size;
+}
+
+static void fill_pattern(char *buf, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (char)('a' + i % 26);
+	}
+}
+
+static bool payload_init(const char *spec) {
+	char buf[4096];
+	fill_pattern(buf, sizeof(buf));
+
+	if (strncmp(spec, "file:", 5) == 0) {
+		payload.kind = PAYLOAD_FILE;
+		payload.fd = open(spec + 5, O_RDONLY | O_CLOEXEC);
+		if (payload.fd == -1) {
+			fprintf(stderr, "failed to open %s: %s\n", spec + 5,
+				strerror(errno));
+			return false;
+		}
+		payload.size = lseek(payload.fd, 0, SEEK_END);
+		if (payload.size <= 0) {
+			return payload.size == 0;
+		}
+		payload.data_len = payload.size;
+		payload.data = mmap(NULL, payload.data_len, PROT_READ, MAP_SHARED,
+			payload.fd, 0);
+		return payload.data != MAP_FAILED;
+	} else if (strncmp(spec, "memfd:", 6) == 0) {
+		payload.kind = PAYLOAD_MEMFD;
+		payload.size = parse_size(spec + 6);
+		payload.fd = memfd_create("copy-fu-payload", MFD_CLOEXEC);
+		if (payload.size < 0 || payload.fd == -1 ||
+				ftruncate(payload.fd, payload.size) == -1) {
+			return false;
+		}
+		if (payload.size == 0) {
+			return true;
+		}
+		payload.data_len = payload.size;
+		payload.data = mmap(NULL, payload.data_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, payload.fd, 0);
+		if (payload.data == MAP_FAILED) {
+			return false;
+		}
+		fill_pattern(payload.data, payload.data_len);
+		return true;
+	} else if (strncmp(spec, "pattern:", 8) == 0) {
+		payload.kind = PAYLOAD_PATTERN;
+		payload.size = parse_size(spec + 8);
+		int fds[2];
+		if (payload.size < 0 || pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+			return false;
+		}
+		/* tee never consumes the pipe content, fill it up once */
+		fcntl(fds[1], F_SETPIPE_SZ, PATTERN_PIPE_SIZE);
+		while (write(fds[1], buf, sizeof(buf)) > 0) {
+			// This space intentionally left blank
+		}
+		close(fds[1]);
+		payload.fd = fds[0];
+
+		/* one extra period, so that a chunk can start at any offset */
+		payload.data_len = PATTERN_PIPE_SIZE + 26;
+		payload.data = malloc(payload.data_len);
+		if (payload.data == NULL) {
+			return false;
+		}
+		fill_pattern(payload.data, payload.data_len);
+		return true;
+	}
+	return false;
+}
+
+/* Tees the pattern into the relay pipe once it's been drained, and splices
+ * it into the destination */
+static ssize_t relay_send(struct transfer *transfer, off_t remaining) {
+	if (transfer->relayed == 0) {
+		ssize_t n = tee(payload.fd, transfer->relay[1], remaining,
+			SPLICE_F_NONBLOCK);
+		if (n <= 0) {
+			return n;
+		}
+		transfer->relayed = n;
+	}
+
+	ssize_t n = splice(transfer->relay[0], NULL, transfer->fd, NULL,
+		transfer->relayed, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+	if (n > 0) {
+		transfer->relayed -= n;
+		transfer->offset += n;
+	}
+	return n;
+}
+
+static bool stream_send(struct transfer *transfer);
+
+/* Returns true once the transfer is over */
+static bool payload_send(struct transfer *transfer) {
+	off_t remaining = payload.size - transfer->offset;
+	ssize_t n = 0;
+	if (remaining > 0) {
+		if (payload.kind == PAYLOAD_PATTERN && transfer->relay[0] != -1) {
+			n = relay_send(transfer, remaining);
+		} else if (payload.kind == PAYLOAD_PATTERN) {
+			n = tee(payload.fd, transfer->fd, remaining, SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				transfer->offset += n;
+			}
+		} else {
+			n = sendfile(transfer->fd, payload.fd, &transfer->offset,
+				remaining);
+		}
+	}
+	transfer_progress(transfer, n);
+
+	if (n < 0 && errno == EINVAL) {
+		/* splice refuses some destinations, such as files opened with
+		 * O_APPEND: copy through userspace instead */
+		printf("Can't splice to fd=%d, falling back to writes\n",
+			transfer->fd);
+		transfer->send_type = SEND_STREAM;
+		return stream_send(transfer);
+	} else if (n < 0 && errno == EAGAIN) {
+		return false;
+	} else if (n < 0) {
+		printf("Sending to fd=%d failed: %s\n", transfer->fd,
+			strerror(errno));
+		return true;
+	} else if (transfer->offset < payload.size && n > 0) {
+		return false;
+	}
+
+	print_throughput("Sent", transfer);
+	return true;
+}
+
+/* Returns true once the transfer is over */
+static bool splice_recv(struct transfer *transfer) {
+	ssize_t n = splice(transfer->fd, NULL, devnull, NULL, PATTERN_PIPE_SIZE,
+		SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+	transfer_progress(transfer, n);
+	if (n > 0) {
+		transfer->offset += n;
+		return false;
+	} else if (n < 0 && errno == EAGAIN) {
+		return false;
+	} else if (n < 0) {
+		printf("Receiving from fd=%d failed: %s\n", transfer->fd,
+			strerror(errno));
+		return true;
+	}
+
+	if (mode != CHURN) {
+		print_throughput("Received", transfer);
+	}
+	return true;
+}
+
+/* Returns the data left to send from the current offset */
+static const char *send_chunk(struct transfer *transfer, size_t *len) {
+	static const uint64_t magic = 0x049a7b1504ec38ed;
+	static const char msg[] = "A text-type message";
+	size_t offset = (size_t)transfer->offset;
+
+	switch (transfer->send_type) {
+	case SEND_OCTET_STREAM:
+		*len = sizeof(magic) - offset;
+		return (const char *)&magic + offset;
+	case SEND_TEXT:
+		*len = strlen(msg) - offset;
+		return msg + offset;
+	case SEND_STREAM:
+		*len = (size_t)(payload.size - transfer->offset);
+		if (payload.kind == PAYLOAD_PATTERN) {
+			if (*len > PATTERN_PIPE_SIZE) {
+				*len = PATTERN_PIPE_SIZE;
+			}
+			return payload.data + offset % 26;
+		}
+		return payload.data + offset;
+	default:
+		abort();
+	}
+}
+
+/* Writes as much as the peer accepts without blocking, picking up where the
+ * last short write left off. Returns true once the transfer is over. */
+static bool stream_send(struct transfer *transfer) {
+	while (1) {
+		size_t len;
+		const char *data = send_chunk(transfer, &len);
+		if (len == 0) {
+			if (transfer->send_type == SEND_STREAM) {
+				print_throughput("Sent", transfer);
+			}
+			return true;
+		}
+
+		ssize_t n = write(transfer->fd, data, len);
+		transfer_progress(transfer, n);
+		if (n < 0 && errno == EAGAIN) {
+			return false;
+		} else if (n < 0) {
+			printf("Sending to fd=%d failed: %s\n", transfer->fd,
+				strerror(errno));
+			return true;
+		}
+		transfer->offset += n;
+		if ((size_t)n < len) {
+			/* short write, the peer is behind: wait for the next
+			 * EPOLLOUT */
+			if (transfer->stall_start == 0) {
+				transfer->stall_start = get_time_ns();
+			}
+			return false;
+		}
+	}
+}
+
+static uint32_t hash_mimetype(const char *str) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (; *str; str++) {
+		hash = (hash ^ (uint8_t)*str) * 16777619u;
+	}
+	return hash;
+}
+
+static bool offer_table_grow(void) {
+	size_t nbuckets = offers.nbuckets ?
+		2 * offers.nbuckets : OFFER_TABLE_MIN_BUCKETS;
+	struct mimetype_offer **buckets =
+		calloc(nbuckets, sizeof(struct mimetype_offer *));
+	if (buckets == NULL) {
+		return false;
+	}
+
+	struct mimetype_offer *offer;
+	wl_list_for_each(offer, &offers.list, link) {
+		size_t i = offer->hash & (nbuckets - 1);
+		offer->next_in_bucket = buckets[i];
+		buckets[i] = offer;
+	}
+	free(offers.buckets);
+	offers.buckets = buckets;
+	offers.nbuckets = nbuckets;
+	return true;
+}
+
+/* Returns false if the mime type was already offered */
+static bool offer_table_add(const char *mime_type) {
+	uint32_t hash = hash_mimetype(mime_type);
+	if (offers.nbuckets > 0) {
+		struct mimetype_offer *offer =
+			offers.buckets[hash & (offers.nbuckets - 1)];
+		for (; offer != NULL; offer = offer->next_in_bucket) {
+			if (offer->hash == hash && !strcmp(offer->val, mime_type)) {
+				offers.duplicates++;
+				return false;
+			}
+		}
+	}
+
+	if (offers.len >= offers.nbuckets && !offer_table_grow()) {
+		fprintf(stderr, "allocation failed\n");
+		return true;
+	}
+
+	struct mimetype_offer *e = calloc(1, sizeof(struct mimetype_offer));
+	if (e == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return true;
+	}
+	e->val = strdup(mime_type);
+	e->hash = hash;
+	size_t i = hash & (offers.nbuckets - 1);
+	e->next_in_bucket = offers.buckets[i];
+	offers.buckets[i] = e;
+	wl_list_insert(&offers.list, &e->link);
+	offers.len++;
+	return true;
 }
 
 static void clear_offer_stack(void) {
 	struct mimetype_offer *offer = NULL, *tmp_offer = NULL;
-	wl_list_for_each_safe(offer, tmp_offer, &offer_list, link) {
+	wl_list_for_each_safe(offer, tmp_offer, &offers.list, link) {
 		wl_list_remove(&offer->link);
+		free(offer->val);
 		free(offer);
 	}
+	if (offers.nbuckets > 0) {
+		memset(offers.buckets, 0,
+			offers.nbuckets * sizeof(struct mimetype_offer *));
+	}
+	offers.len = 0;
+	offers.duplicates = 0;
+	offers.handling_time = 0;
 }
 
 static void data_source_target(void *data,
@@ -134,11 +698,18 @@ static void data_source_target(void *data,
 
 static void data_source_send(void *data, struct wl_data_source *wl_data_source,
 		const char *mime_type, int32_t fd) {
+	/* the peer may be slow to read, never block on it */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
 	enum send_type stype = SEND_TEXT;
-	if (!strcmp(mime_type, "application/octet-stream")) {
+	if (mode == SPLICE_SOURCE || mode == DND) {
+		stype = SEND_PAYLOAD;
+	} else if (mode == STREAM_SOURCE) {
+		stype = SEND_STREAM;
+	} else if (!strcmp(mime_type, "application/octet-stream")) {
 		stype = SEND_OCTET_STREAM;
 	}
-	add_set_fd(fd, stype, RECV_NOT);
+	add_transfer(fd, stype, RECV_NOT);
 }
 static void data_source_cancelled(void *data,
 		struct wl_data_source *wl_data_source) {
@@ -148,13 +719,38 @@ static void data_source_cancelled(void *data,
 
 static void data_source_dnd_drop_performed(void *data,
 		struct wl_data_source *wl_data_source) {
+	printf("Drop performed\n");
 }
 static void data_source_dnd_finished(void *data,
 		struct wl_data_source *wl_data_source) {
+	if (dnd.drop_time != 0) {
+		latency_stats_add(&dnd.finish_latency,
+			get_time_ns() - dnd.drop_time);
+		latency_stats_print(&dnd.finish_latency, "drop to finished");
+		dnd.drop_time = 0;
+	}
+	wl_data_source_destroy(data_source);
+	data_source = NULL;
+}
+
+static const char *dnd_action_name(uint32_t dnd_action) {
+	switch (dnd_action) {
+	case WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY:
+		return "copy";
+	case WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE:
+		return "move";
+	case WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK:
+		return "ask";
+	default:
+		return "none";
+	}
 }
 
 static void data_source_action(void *data, struct wl_data_source *wl_data_source,
 		uint32_t dnd_action) {
+	if (mode == DND) {
+		printf("Source action: %s\n", dnd_action_name(dnd_action));
+	}
 }
 
 
@@ -164,11 +760,17 @@ static void data_offer_offer(void *data, struct wl_data_offer *wl_data_offer,
 		fprintf(stderr, "Warning: data offer mismatch\n");
 	}
 
-	struct mimetype_offer *e = calloc(1, sizeof(struct mimetype_offer));
-	e->val = strdup(mime_type);
-	wl_list_insert(&offer_list, &e->link);
+	uint64_t start = get_time_ns();
+	bool added = offer_table_add(mime_type);
+	offers.handling_time += get_time_ns() - start;
 
-	printf("Received offer #%d for %s\n", wl_list_length(&offer_list), mime_type);
+	if (mode == OFFER_FLOOD || mode == CHURN) {
+		return;
+	} else if (!added) {
+		printf("Received duplicate offer for %s\n", mime_type);
+	} else {
+		printf("Received offer #%zu for %s\n", offers.len, mime_type);
+	}
 }
 
 static void data_offer_source_actions(void *data,
@@ -177,6 +779,9 @@ static void data_offer_source_actions(void *data,
 
 static void data_offer_action(void *data, struct wl_data_offer *wl_data_offer,
 		uint32_t dnd_action) {
+	if (mode == DND) {
+		printf("Offer action: %s\n", dnd_action_name(dnd_action));
+	}
 }
 
 
@@ -192,8 +797,24 @@ static void pointer_handle_button(void *data, struct wl_pointer *wl_pointer,
 		memcpy(toplevel.surface.color, color, sizeof(float[4]));
 	}
 
-	/* Attempt copy selection on click */
-	if (button_state == WL_POINTER_BUTTON_STATE_PRESSED) {
+	if (mode == DND && button_state == WL_POINTER_BUTTON_STATE_PRESSED) {
+		if (data_source) {
+			wl_data_source_destroy(data_source);
+		}
+
+		printf("Starting a drag for %lld bytes\n", (long long)payload.size);
+		data_source = wl_data_device_manager_create_data_source(data_device_manager);
+		wl_data_source_add_listener(data_source,
+			&data_source_listener, NULL);
+		wl_data_source_offer(data_source, "application/octet-stream");
+		wl_data_source_set_actions(data_source,
+			WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY |
+			WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE);
+		wl_data_device_start_drag(data_device, data_source,
+			toplevel.surface.wl_surface, NULL, serial);
+		dnd.last_report = get_time_ns();
+	} else if (button_state == WL_POINTER_BUTTON_STATE_PRESSED) {
+		/* Attempt copy selection on click */
 		if (data_source) {
 			wl_data_source_destroy(data_source);
 		}
@@ -213,6 +834,29 @@ static void pointer_handle_button(void *data, struct wl_pointer *wl_pointer,
 			/* because clients will fall for this format */
 			wl_data_source_offer(data_source,
 				"text/plain;charset=utf-8");
+		} else if (mode == SPLICE_SOURCE || mode == STREAM_SOURCE) {
+			printf("Sending a data source offer for %lld bytes\n",
+				(long long)payload.size);
+			wl_data_source_offer(data_source,
+				"application/octet-stream");
+		} else if (mode == OFFER_FLOOD) {
+			printf("Sending a data source offer with %d mime types\n",
+				offer_flood_count);
+			compositor_rss = get_process_rss(compositor_pid);
+			offer_flood_start = get_time_ns();
+			for (int i = 0; i < offer_flood_count; i++) {
+				char mime_type[64];
+				/* every tenth one is a duplicate of the previous */
+				snprintf(mime_type, sizeof(mime_type),
+					"application/x-wleird-flood-%d",
+					i % 10 == 9 ? i - 1 : i);
+				wl_data_source_offer(data_source, mime_type);
+				if (i % OFFER_FLOOD_BATCH == OFFER_FLOOD_BATCH - 1 &&
+						!display_flush_blocking(display)) {
+					fprintf(stderr, "flush failed\n");
+					return;
+				}
+			}
 		}
 
 		/* Adding a large number to the serial can break other client's
@@ -263,11 +907,35 @@ static void receive_offer(const char *mimetype, bool via_sockpair, bool send_unp
 		close(fds[1]);
 
 		enum recv_type rtype = RECV_TEXT;
-		if (!strcmp(mimetype, "application/octet-stream")) {
+		if (mode == SPLICE_SINK || mode == CHURN) {
+			rtype = RECV_SPLICE;
+		} else if (!strcmp(mimetype, "application/octet-stream")) {
 			rtype = RECV_OCTET_STREAM;
 		}
-		add_set_fd(fds[0], SEND_NOT, rtype);
-		printf("Receiving offer for %s\n", mimetype);
+		add_transfer(fds[0], SEND_NOT, rtype);
+		if (mode != RECV_FLOOD && mode != CHURN) {
+			printf("Receiving offer for %s\n", mimetype);
+		}
+	}
+}
+
+static void churn_selection(struct wl_data_offer *id) {
+	if (churn.role != CHURN_RECEIVER || id == NULL) {
+		return;
+	}
+
+	churn.selections++;
+	struct mimetype_offer *offer = NULL;
+	wl_list_for_each(offer, &offers.list, link) {
+		if (strncmp(offer->val, CHURN_MIMETYPE,
+				strlen(CHURN_MIMETYPE)) == 0) {
+			uint64_t set_time = strtoull(
+				offer->val + strlen(CHURN_MIMETYPE), NULL, 10);
+			latency_stats_add(&churn.delivery_latency,
+				get_time_ns() - set_time);
+		} else {
+			receive_offer(offer->val, false, false);
+		}
 	}
 }
 
@@ -275,14 +943,39 @@ static void data_device_selection(void *data,
 		struct wl_data_device *wl_data_device,
 		struct wl_data_offer *id) {
 
+	if (mode == CHURN) {
+		if (!churn.data_control) {
+			churn_selection(id);
+		}
+		return;
+	}
+
 	if (id == NULL) {
 		printf("No selection\n");
 		return;
 	}
 	printf("Updated selection\n");
+	if (mode == OFFER_FLOOD) {
+		/* our own selection comes back to us, with all of the flood */
+		uint64_t rss = get_process_rss(compositor_pid);
+		size_t received = offers.len + offers.duplicates;
+		printf("Handled %zu mime types (%d duplicates) in %.1fms, "
+			"%.0fns per offer\n", offers.len, offers.duplicates,
+			offers.handling_time / 1e6, received > 0 ?
+			(double)offers.handling_time / received : 0.0);
+		if (offer_flood_start != 0) {
+			printf("Selection came back after %.1fms, compositor RSS "
+				"grew by %lld KiB\n",
+				(get_time_ns() - offer_flood_start) / 1e6,
+				((long long)rss - (long long)compositor_rss) / 1024);
+			offer_flood_start = 0;
+		}
+		return;
+	}
+
 	struct mimetype_offer *offer = NULL;
-	wl_list_for_each(offer, &offer_list, link) {
-		if (mode == DEFAULT) {
+	wl_list_for_each(offer, &offers.list, link) {
+		if (mode == DEFAULT || mode == SPLICE_SINK) {
 			receive_offer(offer->val, false, false);
 		} else if (mode == RECV_SOCKETPAIR) {
 			receive_offer(offer->val, true, false);
@@ -304,12 +997,167 @@ static void data_device_selection(void *data,
 		} else if (mode == RECV_FLOOD) {
 			// Sending many file descriptors; this can kill
 			// the source program if its limits are too low...
-			printf("Making %d receive requests...\n", 100);
-			for (int i=0;i<100;i++) {
-				wl_data_offer_receive(data_offer, offer->val, devnull);
+			printf("Making %d receive requests...\n", RECV_FLOOD_COUNT);
+			flood_start = get_time_ns();
+			for (int i = 0; i < RECV_FLOOD_COUNT; i++) {
+				receive_offer(offer->val, false, false);
+				if (i % RECV_FLOOD_BATCH == RECV_FLOOD_BATCH - 1 &&
+						!display_flush_blocking(display)) {
+					fprintf(stderr, "flush failed\n");
+					return;
+				}
+			}
+		}
+	}
+}
+
+static void dnd_report(void) {
+	uint64_t now = get_time_ns();
+	if (now - dnd.last_report < 1000000000) {
+		return;
+	}
+	double elapsed = (now - dnd.last_report) / 1e9;
+	printf("dnd: motions=%.0f/s enters=%d leaves=%d\n",
+		dnd.motions / elapsed, dnd.enters, dnd.leaves);
+	dnd.motions = dnd.enters = dnd.leaves = 0;
+	dnd.last_report = now;
+}
+
+static void data_device_enter(void *data, struct wl_data_device *wl_data_device,
+		uint32_t serial, struct wl_surface *surface, wl_fixed_t x,
+		wl_fixed_t y, struct wl_data_offer *id) {
+	/* other modes ignore drags, like any client not taking drops */
+	if (mode != DND) {
+		return;
+	}
+	dnd.enters++;
+	dnd_report();
+	if (id == NULL) {
+		return;
+	}
+
+	/* the drag offer must outlive the next selection offer */
+	if (id == data_offer) {
+		data_offer = NULL;
+	}
+	dnd.offer = id;
+	wl_data_offer_accept(id, serial, "application/octet-stream");
+	wl_data_offer_set_actions(id,
+		WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY |
+		WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE,
+		WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE);
+}
+
+static void data_device_leave(void *data,
+		struct wl_data_device *wl_data_device) {
+	if (mode != DND) {
+		return;
+	}
+	dnd.leaves++;
+	dnd_report();
+	if (dnd.offer != NULL && dnd.drop_time == 0) {
+		wl_data_offer_destroy(dnd.offer);
+		dnd.offer = NULL;
+	}
+}
+
+static void data_device_motion(void *data, struct wl_data_device *wl_data_device,
+		uint32_t time, wl_fixed_t x, wl_fixed_t y) {
+	if (mode != DND) {
+		return;
+	}
+	dnd.motions++;
+	dnd_report();
+}
+
+static void data_device_drop(void *data, struct wl_data_device *wl_data_device) {
+	if (mode != DND || dnd.offer == NULL) {
+		return;
+	}
+
+	printf("Dropped, receiving\n");
+	dnd.drop_time = get_time_ns();
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		printf("Failed to create pipe, %s", strerror(errno));
+		return;
+	}
+	wl_data_offer_receive(dnd.offer, "application/octet-stream", fds[1]);
+	close(fds[1]);
+	add_transfer(fds[0], SEND_NOT, RECV_SPLICE);
+}
+
+static void dnd_transfer_done(void) {
+	if (dnd.offer == NULL) {
+		return;
+	}
+	wl_data_offer_finish(dnd.offer);
+	wl_data_offer_destroy(dnd.offer);
+	dnd.offer = NULL;
+}
+
+/* Reads or writes whatever the ready events allow, and releases the transfer
+ * once it's over */
+static void handle_transfer(struct transfer *transfer, uint32_t rev) {
+	int fd = transfer->fd;
+	if (transfer->recv_type == RECV_SPLICE &&
+			(rev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		if (splice_recv(transfer)) {
+			transfer->refcount--;
+		}
+	} else if (transfer->recv_type != RECV_NOT &&
+			(rev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		char buf[4096];
+		int nr = (int)read(fd, buf, sizeof(buf));
+
+		/* then actually read, print results */
+		if (nr > 0 && mode != RECV_FLOOD) {
+			printf("Received from fd=%d: %.*s\n", fd, nr, buf);
+		}
+		if (nr > 0) {
+			transfer->read_counter += nr;
+		} else if (nr == 0 || errno != EAGAIN) {
+			/* end of file, or broken */
+			transfer->refcount--;
+		}
+	}
+	if (transfer->send_type == SEND_PAYLOAD && (rev & EPOLLOUT)) {
+		if (payload_send(transfer)) {
+			transfer->refcount--;
+		}
+	} else if (transfer->send_type != SEND_NOT && (rev & EPOLLOUT)) {
+		if (transfer->send_type != SEND_STREAM &&
+				mode != CHURN) {
+			printf("Writing to %d, already wrote %d\n", fd, transfer->write_counter);
+		}
+		if (mode == CAT_RANDOM) {
+			/* there is no end to random data, a short
+			 * write only loses some of it */
+			char buf[4096];
+			int nr = (int)read(urandom, buf, sizeof(buf));
+			if (nr > 0) {
+				ssize_t n = write(fd, buf, (size_t)nr);
+				transfer_progress(transfer, n);
+				if (n > 0) {
+					transfer->write_counter += (int)n;
+				}
+			} else if (nr < 0) {
+				transfer->refcount--;
 			}
+		} else if (stream_send(transfer)) {
+			transfer->refcount--;
 		}
 	}
+
+	if (transfer->send_type != SEND_NOT &&
+			(rev & (EPOLLHUP | EPOLLERR))) {
+		if (transfer->refcount > 0) {
+			transfer->refcount--;
+		}
+	}
+	if (transfer->refcount <= 0) {
+		release_transfer(transfer);
+	}
 }
 
 static void steal_done(void *data, struct wl_callback *wl_callback,
@@ -344,10 +1192,10 @@ static const struct wl_pointer_listener pointer_listener = {
 
 static const struct wl_data_device_listener data_device_listener = {
 	.data_offer = data_device_data_offer,
-	.enter = noop,
-	.leave = noop,
-	.motion = noop,
-	.drop = noop,
+	.enter = data_device_enter,
+	.leave = data_device_leave,
+	.motion = data_device_motion,
+	.drop = data_device_drop,
 	.selection = data_device_selection,
 };
 
@@ -355,6 +1203,285 @@ static const struct wl_callback_listener steal_callback_listener = {
 	.done = steal_done,
 };
 
+#ifdef HAVE_EXT_DATA_CONTROL
+struct churn_offer {
+	uint64_t set_time; // 0 if the selection isn't from an owner
+	bool text;
+};
+
+static void control_offer_offer(void *data,
+		struct ext_data_control_offer_v1 *offer, const char *mime_type) {
+	struct churn_offer *churn_offer = data;
+	if (churn_offer == NULL) {
+		return;
+	} else if (strncmp(mime_type, CHURN_MIMETYPE,
+			strlen(CHURN_MIMETYPE)) == 0) {
+		churn_offer->set_time = strtoull(
+			mime_type + strlen(CHURN_MIMETYPE), NULL, 10);
+	} else if (strcmp(mime_type, "text/plain;charset=utf-8") == 0) {
+		churn_offer->text = true;
+	}
+}
+
+static const struct ext_data_control_offer_v1_listener control_offer_listener = {
+	.offer = control_offer_offer,
+};
+
+static void control_offer_destroy(struct ext_data_control_offer_v1 *offer) {
+	free(ext_data_control_offer_v1_get_user_data(offer));
+	ext_data_control_offer_v1_destroy(offer);
+}
+
+static void control_device_data_offer(void *data,
+		struct ext_data_control_device_v1 *device,
+		struct ext_data_control_offer_v1 *id) {
+	/* without memory, the offer is only ignored */
+	struct churn_offer *churn_offer = calloc(1, sizeof(struct churn_offer));
+	ext_data_control_offer_v1_add_listener(id, &control_offer_listener,
+		churn_offer);
+}
+
+static void control_device_selection(void *data,
+		struct ext_data_control_device_v1 *device,
+		struct ext_data_control_offer_v1 *id) {
+	if (churn.selection != NULL) {
+		control_offer_destroy(churn.selection);
+	}
+	churn.selection = id;
+	if (id == NULL || churn.role != CHURN_RECEIVER) {
+		return;
+	}
+
+	struct churn_offer *churn_offer = ext_data_control_offer_v1_get_user_data(id);
+	if (churn_offer == NULL || churn_offer->set_time == 0) {
+		return;
+	}
+	churn.selections++;
+	latency_stats_add(&churn.delivery_latency,
+		get_time_ns() - churn_offer->set_time);
+
+	if (churn_offer->text) {
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			printf("Failed to create pipe, %s\n", strerror(errno));
+			return;
+		}
+		ext_data_control_offer_v1_receive(id, "text/plain;charset=utf-8",
+			fds[1]);
+		close(fds[1]);
+		add_transfer(fds[0], SEND_NOT, RECV_SPLICE);
+	}
+}
+
+static void control_device_primary_selection(void *data,
+		struct ext_data_control_device_v1 *device,
+		struct ext_data_control_offer_v1 *id) {
+	if (id != NULL) {
+		control_offer_destroy(id);
+	}
+}
+
+static void control_device_finished(void *data,
+		struct ext_data_control_device_v1 *device) {
+	fprintf(stderr, "data control device is gone\n");
+	ext_data_control_device_v1_destroy(device);
+	churn.device = NULL;
+}
+
+static const struct ext_data_control_device_v1_listener control_device_listener = {
+	.data_offer = control_device_data_offer,
+	.selection = control_device_selection,
+	.finished = control_device_finished,
+	.primary_selection = control_device_primary_selection,
+};
+
+static void control_source_send(void *data,
+		struct ext_data_control_source_v1 *source, const char *mime_type,
+		int32_t fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	add_transfer(fd, SEND_TEXT, RECV_NOT);
+}
+
+static void control_source_cancelled(void *data,
+		struct ext_data_control_source_v1 *source) {
+	ext_data_control_source_v1_destroy(source);
+}
+
+static const struct ext_data_control_source_v1_listener control_source_listener = {
+	.send = control_source_send,
+	.cancelled = control_source_cancelled,
+};
+
+static void control_set_selection(void) {
+	if (churn.device == NULL) {
+		return;
+	}
+
+	struct ext_data_control_source_v1 *source =
+		ext_data_control_manager_v1_create_data_source(churn.manager);
+	ext_data_control_source_v1_add_listener(source, &control_source_listener,
+		NULL);
+	ext_data_control_source_v1_offer(source, "text/plain;charset=utf-8");
+
+	char mime_type[64];
+	snprintf(mime_type, sizeof(mime_type), CHURN_MIMETYPE "%llu",
+		(unsigned long long)get_time_ns());
+	ext_data_control_source_v1_offer(source, mime_type);
+
+	/* the previous source gets cancelled */
+	ext_data_control_device_v1_set_selection(churn.device, source);
+	churn.selections++;
+}
+#endif
+
+static void churn_registry_handle_global(void *data,
+		struct wl_registry *registry, uint32_t name, const char *interface,
+		uint32_t version) {
+#ifdef HAVE_EXT_DATA_CONTROL
+	if (strcmp(interface, ext_data_control_manager_v1_interface.name) == 0) {
+		churn.manager = wl_registry_bind(registry, name,
+			&ext_data_control_manager_v1_interface, 1);
+	}
+#endif
+}
+
+static const struct wl_registry_listener churn_registry_listener = {
+	.global = churn_registry_handle_global,
+	.global_remove = noop,
+};
+
+static void churn_init(void) {
+	struct wl_registry *registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &churn_registry_listener, NULL);
+	wl_display_roundtrip(display);
+	wl_registry_destroy(registry);
+
+#ifdef HAVE_EXT_DATA_CONTROL
+	if (churn.manager != NULL) {
+		churn.device = ext_data_control_manager_v1_get_data_device(
+			churn.manager, seat);
+		ext_data_control_device_v1_add_listener(churn.device,
+			&control_device_listener, NULL);
+		churn.data_control = true;
+		return;
+	}
+#endif
+	if (churn.role == CHURN_RECEIVER && churn.index == 0) {
+		printf("No ext-data-control, falling back to wl_data_device: "
+			"only a focused receiver gets selections, and owners "
+			"may be refused\n");
+	}
+}
+
+static void churn_sync_done(void *data, struct wl_callback *wl_callback,
+		uint32_t callback_data) {
+	wl_callback_destroy(wl_callback);
+	churn.sync_pending = false;
+
+	if (data_source) {
+		wl_data_source_destroy(data_source);
+	}
+	data_source = wl_data_device_manager_create_data_source(
+		data_device_manager);
+	wl_data_source_add_listener(data_source, &data_source_listener, NULL);
+	wl_data_source_offer(data_source, "text/plain;charset=utf-8");
+
+	char mime_type[64];
+	snprintf(mime_type, sizeof(mime_type), CHURN_MIMETYPE "%llu",
+		(unsigned long long)get_time_ns());
+	wl_data_source_offer(data_source, mime_type);
+
+	/* like steal-sync, since owners never get any input */
+	wl_data_device_set_selection(data_device, data_source, callback_data);
+	churn.selections++;
+}
+
+static const struct wl_callback_listener churn_callback_listener = {
+	.done = churn_sync_done,
+};
+
+/* Returns the epoll timeout until the next selection change */
+static int churn_tick(void) {
+	uint64_t now = get_time_ns();
+	if (churn.role == CHURN_OWNER && now >= churn.next_tick) {
+#ifdef HAVE_EXT_DATA_CONTROL
+		if (churn.data_control) {
+			control_set_selection();
+		}
+#endif
+		if (!churn.data_control && !churn.sync_pending) {
+			struct wl_callback *cb = wl_display_sync(display);
+			wl_callback_add_listener(cb, &churn_callback_listener, NULL);
+			churn.sync_pending = true;
+		}
+		churn.next_tick += 1000000000 / churn.rate;
+		if (churn.next_tick < now) {
+			// Can't keep up, don't try to catch up
+			churn.next_tick = now;
+		}
+	}
+
+	if (now - churn.last_report >= 1000000000) {
+		double elapsed = (now - churn.last_report) / 1e9;
+		char name[32];
+		snprintf(name, sizeof(name), "%s %d",
+			churn.role == CHURN_OWNER ? "owner" : "receiver",
+			churn.index);
+		if (churn.role == CHURN_RECEIVER && churn.selections == 0) {
+			printf("%s: no selection received%s\n", name,
+				churn.data_control ? "" :
+				", it probably doesn't have keyboard focus");
+		} else {
+			printf("%s: %.1f selections/s, %d transfers in flight\n",
+				name, churn.selections / elapsed, transfers.active);
+		}
+		if (churn.role == CHURN_RECEIVER && churn.selections > 0) {
+			latency_stats_print(&churn.delivery_latency, name);
+			latency_stats_reset(&churn.delivery_latency);
+		}
+		if (churn.role == CHURN_RECEIVER && churn.index == 0) {
+			printf("compositor: %d fds open\n",
+				get_process_fd_count(compositor_pid));
+		}
+		fflush(stdout);
+		churn.selections = 0;
+		churn.last_report = now;
+	}
+
+	uint64_t next = churn.last_report + 1000000000;
+	if (churn.role == CHURN_OWNER && churn.next_tick < next) {
+		next = churn.next_tick;
+	}
+	return next > now ? (int)((next - now) / 1000000) + 1 : 0;
+}
+
+/* Forks the owners and receivers, and waits for them in the parent. Returns
+ * true in children. */
+static bool churn_fork(void) {
+	int children = churn.owners + churn.receivers;
+	for (int i = 0; i < children; i++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			fprintf(stderr, "fork failed: %s\n", strerror(errno));
+			break;
+		} else if (pid == 0) {
+			if (i < churn.owners) {
+				churn.role = CHURN_OWNER;
+				churn.index = i;
+			} else {
+				churn.role = CHURN_RECEIVER;
+				churn.index = i - churn.owners;
+			}
+			return true;
+		}
+	}
+
+	while (wait(NULL) > 0) {
+		// This space intentionally left blank
+	}
+	return false;
+}
+
 int main(int argc, char *argv[]) {
 	if (argc > 1) {
 		mode = (enum copyfu_mode)-1;
@@ -366,16 +1493,58 @@ int main(int argc, char *argv[]) {
 			}
 		}
 		if (mode == (enum copyfu_mode)-1) {
-			printf("Usage: ./copy-fu [MODE=default]\n");
+			printf("Usage: ./copy-fu [MODE=default] [PAYLOAD]\n");
 			for (size_t i = 0; i < nopts; i++) {
 				printf("%15s %s\n", cli_options[i].name,
 					cli_options[i].description);
 			}
+			printf("PAYLOAD is one of file:PATH, pattern:SIZE or "
+				"memfd:SIZE (default %s)\n", DEFAULT_PAYLOAD);
+			printf("offer-flood takes a mime type count instead "
+				"(default %d)\n", OFFER_FLOOD_COUNT);
+			printf("churn takes [owners] [receivers] [rate] instead "
+				"(default %d, %d and %d/s per owner)\n",
+				CHURN_OWNERS, CHURN_RECEIVERS, CHURN_RATE);
 			return EXIT_FAILURE;
 		}
 	}
 
-	wl_list_init(&offer_list);
+	if (mode == OFFER_FLOOD && argc > 2) {
+		offer_flood_count = atoi(argv[2]);
+		if (offer_flood_count <= 0) {
+			fprintf(stderr, "invalid mime type count %s\n", argv[2]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (mode == CHURN) {
+		if (argc > 2) {
+			churn.owners = atoi(argv[2]);
+		}
+		if (argc > 3) {
+			churn.receivers = atoi(argv[3]);
+		}
+		if (argc > 4) {
+			churn.rate = atoi(argv[4]);
+		}
+		if (churn.owners < 0 || churn.receivers < 0 || churn.rate <= 0) {
+			fprintf(stderr, "invalid churn parameters\n");
+			return EXIT_FAILURE;
+		}
+		if (!churn_fork()) {
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (mode == SPLICE_SOURCE || mode == STREAM_SOURCE || mode == DND) {
+		const char *spec = argc > 2 ? argv[2] : DEFAULT_PAYLOAD;
+		if (!payload_init(spec)) {
+			fprintf(stderr, "failed to set up payload %s\n", spec);
+			return EXIT_FAILURE;
+		}
+	}
+
+	wl_list_init(&offers.list);
 
 	display = wl_display_connect(NULL);
 	if (display == NULL) {
@@ -384,6 +1553,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	registry_init(display);
+	compositor_pid = get_compositor_pid(display);
 
 	if (data_device_manager == NULL) {
 		fprintf(stderr, "no data device manager\n");
@@ -400,27 +1570,44 @@ int main(int argc, char *argv[]) {
 	data_device = wl_data_device_manager_get_data_device(
 		data_device_manager, seat);
 	wl_data_device_add_listener(data_device, &data_device_listener, NULL);
+	if (mode == CHURN) {
+		churn_init();
+	}
 
 
 	toplevel_init(&toplevel);
 	float color[4] = {1.f, 0.3f, 1.f, 1.f};
 	memcpy(toplevel.surface.color, color, sizeof(float[4]));
 
-	int wlfd = wl_display_get_fd(display);
-	fd_set.nfds = 1;
-	fd_set.pfds = calloc(1, sizeof(struct pollfd));
-	fd_set.pfds[0].fd = wlfd;
-	/* it is assumed that the connection is always writeable */
-	fd_set.pfds[0].events = POLLIN;
-	fd_set.meta = calloc(1, sizeof(struct fd_extra));
-	fd_set.meta[0].recv_type = RECV_NOT;
-	fd_set.meta[0].send_type = SEND_NOT;
-	fd_set.meta[0].refcount = 1;
-
-	int urandom = mode == CAT_RANDOM ? open("/dev/urandom", O_RDONLY) : -1;
-	if (mode == ZERO_SINK || mode == RECV_FLOOD) {
+	transfers.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (transfers.epoll_fd == -1) {
+		fprintf(stderr, "epoll_create1 failed\n");
+		return EXIT_FAILURE;
+	}
+	/* the main event loop is the only fd without a transfer;
+	 * it is assumed that the connection is always writeable */
+	struct epoll_event wlev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(transfers.epoll_fd, EPOLL_CTL_ADD, wl_display_get_fd(display),
+		&wlev);
+
+	if (mode == CAT_RANDOM) {
+		urandom = open("/dev/urandom", O_RDONLY);
+	}
+	if (mode == ZERO_SINK || mode == SPLICE_SINK || mode == DND ||
+			mode == CHURN) {
 		devnull = open("/dev/null", O_WRONLY);
 	}
+	if (mode == CHURN) {
+		churn.next_tick = churn.last_report = get_time_ns();
+	}
+	if (mode == RECV_FLOOD || mode == CHURN) {
+		/* every concurrent transfer holds a file descriptor */
+		struct rlimit lim;
+		if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+			lim.rlim_cur = lim.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &lim);
+		}
+	}
 
 	while (1) {
 		if (wl_display_dispatch_pending(display) == -1) {
@@ -438,61 +1625,43 @@ int main(int argc, char *argv[]) {
 		int limit = -1;
 		if (mode == STEAL_SERIAL || mode == STEAL_SYNC) {
 			limit = 1000;
+		} else if (mode == CHURN) {
+			limit = churn_tick();
+		}
+		if (transfers.ready_list != NULL) {
+			limit = 0;
 		}
 
-		int nr = poll(fd_set.pfds, (nfds_t)fd_set.nfds, limit);
+		struct epoll_event events[MAX_EVENTS];
+		int nr = epoll_wait(transfers.epoll_fd, events, MAX_EVENTS, limit);
 		if (nr < 0 && (errno == EAGAIN || errno == EINTR)) {
 			continue;
 		} else if (nr < 0){
-			fprintf(stderr, "poll failure\n");
+			fprintf(stderr, "epoll failure\n");
 			break;
 		}
 
-		if (fd_set.pfds[0].revents & POLLIN) {
-			wl_display_prepare_read(display);
-			wl_display_read_events(display);
-		}
-		for (int i=1;i<fd_set.nfds;i++) {
-			short rev = fd_set.pfds[i].revents;
-			int fd = fd_set.pfds[i].fd;
-			struct fd_extra *meta = &fd_set.meta[i];
-			if (meta->recv_type != RECV_NOT && (rev & POLLIN)) {
-				char buf[4096];
-				int nr = (int)read(fd, buf, sizeof(buf));
-
-				/* then actually read, print results */
-				printf("Received from fd=%d: %.*s\n", fd, nr, buf);
-			}
-			if (meta->send_type != SEND_NOT && (rev & POLLOUT)) {
-				printf("Writing to %d, already wrote %d\n", fd, meta->write_counter);
-				if (mode == CAT_RANDOM) {
-					char buf[4096];
-					int nr = (int)read(urandom, buf, sizeof(buf));
-					if (nr > 0) {
-						write(fd, buf, (size_t)nr);
-						meta->write_counter += nr;
-					} else if (nr < 0) {
-						meta->refcount--;
-					}
-				} else {
-					if (meta->send_type == SEND_OCTET_STREAM) {
-						uint64_t magic = 0x049a7b1504ec38ed;
-						write(fd, &magic, sizeof(magic));
-					} else if (meta->send_type == SEND_TEXT) {
-						const char msg[] = "A text-type message";
-						write(fd, msg, strlen(msg));
-					}
-					meta->refcount--;
+		for (int i = 0; i < nr; i++) {
+			uint32_t rev = events[i].events;
+			struct transfer *transfer = events[i].data.ptr;
+			if (transfer == NULL) {
+				if (rev & EPOLLIN) {
+					wl_display_prepare_read(display);
+					wl_display_read_events(display);
 				}
+				continue;
 			}
 
-			if (rev & POLLHUP) {
-				if (meta->refcount > 0) {
-					meta->refcount--;
-				}
-			}
+			handle_transfer(transfer, rev);
+		}
+
+		struct transfer *transfer = transfers.ready_list;
+		while (transfer != NULL) {
+			/* may be released while handled */
+			struct transfer *next = transfer->next_ready;
+			handle_transfer(transfer, EPOLLIN | EPOLLOUT);
+			transfer = next;
 		}
-		remove_done_fds();
 
 		if (mode == STEAL_SERIAL ||
 				(mode == STEAL_SYNC && steal_state == SYNC_STEAL_READY)) {
@@ -537,5 +1706,14 @@ int main(int argc, char *argv[]) {
 	if (devnull != -1) {
 		close(devnull);
 	}
+	if (payload.kind == PAYLOAD_PATTERN) {
+		free(payload.data);
+	} else if (payload.data != NULL) {
+		munmap(payload.data, payload.data_len);
+	}
+	if (payload.fd != -1) {
+		close(payload.fd);
+	}
+	close(transfers.epoll_fd);
 	return EXIT_SUCCESS;
 }
@@ -113,8 +113,7 @@ static void damage_render(struct wleird_surface *surface) {
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 
-	wl_surface_attach(surface->wl_surface, buffer->buffer,
-		surface->attach_x, surface->attach_y);
+	surface_attach(surface, buffer);
 
 	const int nholes = 50;
 	const int nlines = 53;
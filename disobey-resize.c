@@ -4,29 +4,112 @@
 #include <string.h>
 #include <math.h>
 #include "client.h"
+#include "stats.h"
+
+#define VIEWPORT_BUFFER_SIZE 256
 
 static double factor = 0.0;
 static struct wleird_toplevel toplevel = {0};
+
+/* In viewport mode, a single fixed-size buffer is scaled to the requested
+ * size with wp_viewporter instead of reallocating and repainting a buffer
+ * for every configure. */
+static bool use_viewport = false;
+static struct wp_viewport *viewport = NULL;
+static int dest_width = 0, dest_height = 0;
+
+static uint64_t configure_time = 0;
+static int configures = 0, allocations = 0;
+static struct latency_stats commit_latency = {0};
+
 static void xdg_toplevel_handle_configure(void *data,
 		struct xdg_toplevel *xdg_toplevel, int32_t w, int32_t h,
 		struct wl_array *states) {
 	struct wleird_toplevel *toplevel = data;
+	configure_time = get_time_ns();
 	if (w == 0 || h == 0) {
 		return;
 	}
 
-	toplevel->surface.width = fmax((double)w * factor, 1);
-	toplevel->surface.height = fmax((double)h * factor, 1);
+	dest_width = fmax((double)w * factor, 1);
+	dest_height = fmax((double)h * factor, 1);
+	if (!use_viewport) {
+		toplevel->surface.width = dest_width;
+		toplevel->surface.height = dest_height;
+	}
+}
+
+static void viewport_render(struct wleird_surface *surface) {
+	// Crop the buffer to the aspect ratio of the destination
+	double src_width = surface->width, src_height = surface->height;
+	if (dest_width > dest_height) {
+		src_height = src_width * dest_height / dest_width;
+	} else {
+		src_width = src_height * dest_width / dest_height;
+	}
+	wp_viewport_set_source(viewport,
+		wl_fixed_from_double((surface->width - src_width) / 2),
+		wl_fixed_from_double((surface->height - src_height) / 2),
+		wl_fixed_from_double(src_width), wl_fixed_from_double(src_height));
+	wp_viewport_set_destination(viewport, dest_width, dest_height);
+
+	if (surface->buffers[0].buffer == NULL &&
+			surface->buffers[1].buffer == NULL) {
+		surface_render(surface);
+	} else {
+		wl_surface_commit(surface->wl_surface);
+	}
+}
+
+static void xdg_surface_handle_configure(void *data,
+		struct xdg_surface *xdg_surface, uint32_t serial) {
+	struct wleird_toplevel *toplevel = data;
+	struct wleird_surface *surface = &toplevel->surface;
+
+	xdg_surface_ack_configure(xdg_surface, serial);
+
+	// A reallocated wl_buffer is likely to get the same address back, so
+	// compare the buffer sizes instead
+	struct pool_buffer prev_buffers[2] = {
+		surface->buffers[0],
+		surface->buffers[1],
+	};
+	if (use_viewport && dest_width > 0) {
+		viewport_render(surface);
+	} else {
+		surface_render(surface);
+	}
+	for (size_t i = 0; i < 2; i++) {
+		struct pool_buffer *buffer = &surface->buffers[i];
+		if (buffer->buffer != NULL && (prev_buffers[i].buffer == NULL ||
+				buffer->width != prev_buffers[i].width ||
+				buffer->height != prev_buffers[i].height)) {
+			allocations++;
+		}
+	}
+
+	uint64_t latency = get_time_ns() - configure_time;
+	latency_stats_add(&commit_latency, latency);
+	configures++;
+	fprintf(stderr, "configure %dx%d: committed in %.1fus, "
+		"%d allocations for %d configures\n", dest_width, dest_height,
+		latency / 1000.0, allocations, configures);
+	if (configures % 100 == 0) {
+		latency_stats_print(&commit_latency, "configure to commit");
+		latency_stats_reset(&commit_latency);
+	}
 }
 
 static int usage(char* bin) {
-	fprintf(stderr, "Usage: %s [size_factor]\n", bin);
+	fprintf(stderr, "Usage: %s [size_factor] [shm|viewport]\n", bin);
 	fprintf(stderr, "size_factor: A floating point factor greater than 0.0 to apply to the requested size\n");
+	fprintf(stderr, "shm: reallocate a buffer at the new size (default)\n");
+	fprintf(stderr, "viewport: scale a single fixed-size buffer with wp_viewporter\n");
 	return EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
+	if (argc != 2 && argc != 3) {
 		return usage(argv[0]);
 	}
 
@@ -35,17 +118,39 @@ int main(int argc, char *argv[]) {
 		return usage(argv[0]);
 	}
 
+	if (argc == 3) {
+		if (strcmp(argv[2], "viewport") == 0) {
+			use_viewport = true;
+		} else if (strcmp(argv[2], "shm") != 0) {
+			return usage(argv[0]);
+		}
+	}
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
 		return EXIT_FAILURE;
 	}
 
+	xdg_surface_listener.configure = xdg_surface_handle_configure;
 	xdg_toplevel_listener.configure = xdg_toplevel_handle_configure;
 
 	registry_init(display);
+
+	if (use_viewport && viewporter == NULL) {
+		fprintf(stderr, "compositor doesn't support wp_viewporter\n");
+		return EXIT_FAILURE;
+	}
+
 	toplevel_init(&toplevel);
 
+	if (use_viewport) {
+		viewport = wp_viewporter_get_viewport(viewporter,
+			toplevel.surface.wl_surface);
+		toplevel.surface.width = VIEWPORT_BUFFER_SIZE;
+		toplevel.surface.height = VIEWPORT_BUFFER_SIZE;
+	}
+
 	float color[4] = {1, 0, 0, 1};
 	memcpy(toplevel.surface.color, color, sizeof(float[4]));
 
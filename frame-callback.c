@@ -1,14 +1,36 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include "client.h"
+#include "stats.h"
+
+#define WINDOWS_DEFAULT 16
 
 static struct wleird_toplevel toplevel = {0};
 static uint32_t last_time_ms = 0;
 
 static const struct wl_callback_listener callback_listener;
 
+/* In overproduce mode, frames are committed from a timer regardless of frame
+ * callbacks, like a game or video player with vsync disabled. Presentation
+ * feedback tells which of these frames never made it to the screen. */
+static struct {
+	pid_t compositor_pid;
+	uint64_t compositor_cpu_time;
+	uint64_t last_report;
+	// Counters since the last report
+	int commits, presented, discarded, skipped;
+	// Frame callback fallback, if wp_presentation isn't available
+	bool frame_pending;
+	int commits_since_frame;
+} overproduce = {0};
+
 static void request_frame_callback(void) {
 	struct wl_callback *callback = wl_surface_frame(toplevel.surface.wl_surface);
 	wl_callback_add_listener(callback, &callback_listener, NULL);
@@ -32,7 +54,345 @@ static const struct wl_callback_listener callback_listener = {
 	.done = callback_handle_done,
 };
 
+static void feedback_handle_presented(void *data,
+		struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	wp_presentation_feedback_destroy(feedback);
+	overproduce.presented++;
+}
+
+static void feedback_handle_discarded(void *data,
+		struct wp_presentation_feedback *feedback) {
+	wp_presentation_feedback_destroy(feedback);
+	overproduce.discarded++;
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = noop,
+	.presented = feedback_handle_presented,
+	.discarded = feedback_handle_discarded,
+};
+
+static void overproduce_callback_handle_done(void *data,
+		struct wl_callback *callback, uint32_t time_ms) {
+	wl_callback_destroy(callback);
+
+	// Only the last commit before a repaint can have been presented
+	overproduce.presented++;
+	overproduce.discarded += overproduce.commits_since_frame - 1;
+	overproduce.commits_since_frame = 0;
+	overproduce.frame_pending = false;
+}
+
+static const struct wl_callback_listener overproduce_callback_listener = {
+	.done = overproduce_callback_handle_done,
+};
+
+static void overproduce_commit(void) {
+	struct wleird_surface *surface = &toplevel.surface;
+	if (surface->buffers[0].busy && surface->buffers[1].busy) {
+		// Both buffers are still held by the compositor
+		overproduce.skipped++;
+		return;
+	}
+
+	if (presentation != NULL) {
+		struct wp_presentation_feedback *feedback =
+			wp_presentation_feedback(presentation, surface->wl_surface);
+		wp_presentation_feedback_add_listener(feedback, &feedback_listener,
+			NULL);
+	} else if (!overproduce.frame_pending) {
+		struct wl_callback *callback = wl_surface_frame(surface->wl_surface);
+		wl_callback_add_listener(callback, &overproduce_callback_listener,
+			NULL);
+		overproduce.frame_pending = true;
+	}
+
+	// Alternate colors so that every commit carries new content
+	surface->color[1] = overproduce.commits % 2;
+	surface_render(surface);
+
+	overproduce.commits++;
+	overproduce.commits_since_frame++;
+}
+
+static void overproduce_report(void) {
+	uint64_t now = get_time_ns();
+	uint64_t cpu_time = get_process_cpu_time(overproduce.compositor_pid);
+	double elapsed = (now - overproduce.last_report) / 1e9;
+	double cpu_ms = (cpu_time - overproduce.compositor_cpu_time) / 1e6;
+
+	int done = overproduce.presented + overproduce.discarded;
+	fprintf(stderr, "commits=%.0f/s presented=%d discarded=%d "
+		"skipped=%d drop-rate=%.1f%% compositor-cpu=%.1fms/s",
+		overproduce.commits / elapsed, overproduce.presented,
+		overproduce.discarded, overproduce.skipped,
+		done > 0 ? 100.0 * overproduce.discarded / done : 0.0,
+		cpu_ms / elapsed);
+	if (overproduce.commits > 0) {
+		fprintf(stderr, " per-commit=%.1fus",
+			cpu_ms * 1000 / overproduce.commits);
+	}
+	if (overproduce.discarded > 0) {
+		fprintf(stderr, " per-discarded=%.1fus",
+			cpu_ms * 1000 / overproduce.discarded);
+	}
+	fprintf(stderr, "\n");
+
+	overproduce.last_report = now;
+	overproduce.compositor_cpu_time = cpu_time;
+	overproduce.commits = overproduce.presented = 0;
+	overproduce.discarded = overproduce.skipped = 0;
+}
+
+static int run_overproduce(struct wl_display *display, long rate) {
+	if (presentation == NULL) {
+		fprintf(stderr, "compositor doesn't support wp_presentation, "
+			"falling back to frame callbacks\n");
+	}
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timer_fd == -1) {
+		perror("timerfd_create failed");
+		return EXIT_FAILURE;
+	}
+
+	long interval = 1000000000 / rate;
+	struct itimerspec spec = {
+		.it_interval = { .tv_sec = interval / 1000000000,
+			.tv_nsec = interval % 1000000000 },
+		.it_value = { .tv_sec = interval / 1000000000,
+			.tv_nsec = interval % 1000000000 },
+	};
+	if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1) {
+		perror("timerfd_settime failed");
+		close(timer_fd);
+		return EXIT_FAILURE;
+	}
+
+	overproduce.compositor_pid = get_compositor_pid(display);
+	overproduce.compositor_cpu_time =
+		get_process_cpu_time(overproduce.compositor_pid);
+	overproduce.last_report = get_time_ns();
+	fprintf(stderr, "committing at %ld Hz, compositor pid %d\n", rate,
+		(int)overproduce.compositor_pid);
+
+	struct pollfd fds[] = {
+		{ .fd = wl_display_get_fd(display), .events = POLLIN },
+		{ .fd = timer_fd, .events = POLLIN },
+	};
+	while (true) {
+		while (wl_display_prepare_read(display) != 0) {
+			if (wl_display_dispatch_pending(display) == -1) {
+				goto out;
+			}
+		}
+		if (wl_display_flush(display) == -1 && errno != EAGAIN) {
+			wl_display_cancel_read(display);
+			break;
+		}
+
+		if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) == -1) {
+			wl_display_cancel_read(display);
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(display) == -1) {
+				break;
+			}
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (wl_display_dispatch_pending(display) == -1) {
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+				// Missed ticks aren't caught up on
+				overproduce_commit();
+			}
+		}
+
+		if (get_time_ns() - overproduce.last_report >= 1000000000) {
+			overproduce_report();
+		}
+	}
+
+out:
+	close(timer_fd);
+	return EXIT_SUCCESS;
+}
+
+/* In windows mode, several toplevels run their own frame callback loop. When
+ * they overlap, the compositor has to draw whatever lies beneath them, unless
+ * they declare themselves opaque (see WLEIRD_OPAQUE). */
+struct window {
+	struct wleird_toplevel toplevel;
+	uint64_t commit_time;
+};
+
+static struct {
+	struct window *windows;
+	int len;
+	bool single_pixel;
+
+	pid_t compositor_pid;
+	uint64_t compositor_cpu_time;
+	uint64_t last_report;
+	int commits;
+	struct latency_stats latency;
+} windows = {0};
+
+static const struct wl_callback_listener windows_callback_listener;
+
+static void windows_commit(struct window *window) {
+	struct wleird_surface *surface = &window->toplevel.surface;
+
+	struct wl_callback *callback = wl_surface_frame(surface->wl_surface);
+	wl_callback_add_listener(callback, &windows_callback_listener, window);
+
+	if (surface->buffers[0].busy && surface->buffers[1].busy) {
+		// Keep the loop going even if the compositor holds both buffers
+		wl_surface_commit(surface->wl_surface);
+	} else {
+		surface->color[1] = 1 - surface->color[1];
+		surface_render(surface);
+	}
+
+	window->commit_time = get_time_ns();
+	windows.commits++;
+}
+
+static void windows_report(uint64_t now) {
+	uint64_t cpu_time = get_process_cpu_time(windows.compositor_pid);
+	double elapsed = (now - windows.last_report) / 1e9;
+	double cpu_us = (cpu_time - windows.compositor_cpu_time) / 1e3;
+
+	struct process_usage usage = {0};
+	get_process_usage(windows.compositor_pid, &usage);
+
+	fprintf(stderr, "windows=%d buffers=%s opaque=%s frames=%.1f/s "
+		"compositor-cpu=%.1fms/s per-commit=%.1fus client-rss=%.1fMiB "
+		"compositor-pss=%.1fMiB\n", windows.len,
+		windows.single_pixel ? "single-pixel" : "shm",
+		opaque_regions ? "yes" : "no",
+		windows.latency.len / elapsed / windows.len, cpu_us / 1000 / elapsed,
+		windows.commits > 0 ? cpu_us / windows.commits : 0.0,
+		get_process_rss(getpid()) / 1048576.0, usage.pss / 1048576.0);
+	latency_stats_print(&windows.latency, "commit to frame callback");
+
+	windows.compositor_cpu_time = cpu_time;
+	windows.last_report = now;
+	windows.commits = 0;
+	latency_stats_reset(&windows.latency);
+}
+
+static void windows_callback_handle_done(void *data,
+		struct wl_callback *callback, uint32_t time_ms) {
+	struct window *window = data;
+	wl_callback_destroy(callback);
+
+	uint64_t now = get_time_ns();
+	latency_stats_add(&windows.latency, now - window->commit_time);
+
+	windows_commit(window);
+
+	if (now - windows.last_report >= 1000000000) {
+		windows_report(now);
+	}
+}
+
+static const struct wl_callback_listener windows_callback_listener = {
+	.done = windows_callback_handle_done,
+};
+
+static int run_windows(struct wl_display *display) {
+	if (windows.single_pixel && (single_pixel_buffer_manager == NULL ||
+			viewporter == NULL)) {
+		fprintf(stderr, "compositor doesn't support "
+			"wp_single_pixel_buffer_manager_v1 or wp_viewporter\n");
+		return EXIT_FAILURE;
+	}
+
+	windows.windows = calloc(windows.len, sizeof(struct window));
+	if (windows.windows == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < windows.len; i++) {
+		struct wleird_toplevel *toplevel = &windows.windows[i].toplevel;
+		toplevel_init(toplevel);
+		toplevel->surface.single_pixel = windows.single_pixel;
+		float color[4] = {1, 0, (float)i / windows.len, 1};
+		memcpy(toplevel->surface.color, color, sizeof(float[4]));
+	}
+
+	// Wait for the toplevels to be mapped
+	wl_display_roundtrip(display);
+
+	windows.compositor_pid = get_compositor_pid(display);
+	windows.compositor_cpu_time = get_process_cpu_time(windows.compositor_pid);
+	windows.last_report = get_time_ns();
+
+	for (int i = 0; i < windows.len; i++) {
+		windows_commit(&windows.windows[i]);
+	}
+
+	while (wl_display_dispatch(display) != -1) {
+		// This space intentionally left blank
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [overproduce [rate]|windows [count] "
+		"[shm|single-pixel]]\n", bin);
+	fprintf(stderr, "overproduce: commit at a fixed rate in Hz (default 1000, "
+		"at most 1000000000) regardless of frame callbacks\n");
+	fprintf(stderr, "windows: run a frame callback loop in count toplevels "
+		"(default %d), filled with shm (default) or single-pixel buffers\n",
+		WINDOWS_DEFAULT);
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
+	long rate = 0;
+	if (argc > 1 && strcmp(argv[1], "windows") == 0 && argc <= 4) {
+		windows.len = WINDOWS_DEFAULT;
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "single-pixel") == 0) {
+				windows.single_pixel = true;
+			} else if (strcmp(argv[i], "shm") == 0) {
+				windows.single_pixel = false;
+			} else {
+				windows.len = atoi(argv[i]);
+				if (windows.len <= 0) {
+					return usage(argv[0]);
+				}
+			}
+		}
+	} else if (argc > 3) {
+		return usage(argv[0]);
+	} else if (argc > 1) {
+		if (strcmp(argv[1], "overproduce") != 0) {
+			return usage(argv[0]);
+		}
+		rate = argc > 2 ? strtol(argv[2], NULL, 10) : 1000;
+		// A zero interval would disarm the timer
+		if (rate <= 0 || rate > 1000000000) {
+			return usage(argv[0]);
+		}
+	}
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
@@ -40,11 +400,20 @@ int main(int argc, char *argv[]) {
 	}
 
 	registry_init(display);
+	if (windows.len > 0) {
+		return run_windows(display);
+	}
 	toplevel_init(&toplevel);
 
 	float color[4] = {1, 0, 0, 1};
 	memcpy(toplevel.surface.color, color, sizeof(float[4]));
 
+	if (rate > 0) {
+		// Wait for the initial configure before flooding commits
+		wl_display_roundtrip(display);
+		return run_overproduce(display, rate);
+	}
+
 	request_frame_callback();
 
 	while (wl_display_dispatch(display) != -1) {
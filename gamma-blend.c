@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "client.h"
+#include "stats.h"
 
 /* Reproduces the test pattern described in [1]. This can help reveal whether
  * the blending done by the compositor is gamma-correct.
@@ -9,8 +14,36 @@
  * [1]: http://blog.johnnovak.net/2016/09/21/what-every-coder-should-know-about-gamma/#alpha-blending--compositing
  */
 
+#define WIDTH 400
+#define HEIGHT 400
+
+#define VERIFY_ITERATIONS 10
+#define VERIFY_TOLERANCE 2.0
+#define LINEAR_LUT_SIZE 4096
+
+#define OVERDRAW_MAX_LAYERS 64
+#define OVERDRAW_SIZE 1024
+#define OVERDRAW_STEP_SECONDS 3
+
 static struct wl_subcompositor *subcompositor = NULL;
 
+/* In overdraw mode, N full-size translucent subsurfaces are stacked on top of
+ * an opaque surface, and their alpha is animated so that the compositor has
+ * to blend every layer on every frame. N doubles every few seconds. */
+struct overdraw_layer {
+	struct wleird_surface surface;
+	struct wl_subsurface *subsurface;
+};
+
+static struct {
+	struct wleird_toplevel toplevel;
+	struct overdraw_layer layers[OVERDRAW_MAX_LAYERS];
+	int nlayers, max_layers, size;
+	uint64_t start_time, step_start;
+	int frames, presented, discarded;
+	struct latency_stats latency;
+} overdraw = {0};
+
 static void xdg_surface_handle_configure(void *data,
 		struct xdg_surface *xdg_surface, uint32_t serial) {
 	xdg_surface_ack_configure(xdg_surface, serial);
@@ -48,9 +81,7 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = handle_global_remove,
 };
 
-static void render_main(struct pool_buffer *buffer) {
-	cairo_t *cairo = buffer->cairo;
-
+static void render_main(cairo_t *cairo, int width, int height) {
 	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 1.0);
 	cairo_paint(cairo);
@@ -63,8 +94,8 @@ static void render_main(struct pool_buffer *buffer) {
 	};
 
 	size_t colors_len = sizeof(colors) / sizeof(colors[0]);
-	int w = buffer->width / (colors_len + 2);
-	int h = buffer->height;
+	int w = width / (colors_len + 2);
+	int h = height;
 	int padding = 10;
 	for (size_t i = 0; i < colors_len; i++) {
 		cairo_set_source_rgba(cairo, colors[i][0], colors[i][1], colors[i][2], 1.0);
@@ -73,9 +104,7 @@ static void render_main(struct pool_buffer *buffer) {
 	}
 }
 
-static void render_overlay(struct pool_buffer *buffer) {
-	cairo_t *cairo = buffer->cairo;
-
+static void render_overlay(cairo_t *cairo, int width, int height) {
 	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cairo, 0.0, 0.0, 0.0, 0.0);
 	cairo_paint(cairo);
@@ -87,8 +116,8 @@ static void render_overlay(struct pool_buffer *buffer) {
 	};
 
 	size_t colors_len = sizeof(colors) / sizeof(colors[0]);
-	int w = buffer->width;
-	int h = buffer->height / colors_len / 4;
+	int w = width;
+	int h = height / colors_len / 4;
 	for (size_t i = 0; i < colors_len; i++) {
 		cairo_set_source_rgba(cairo, colors[i][0], colors[i][1], colors[i][2], 1.0);
 		cairo_rectangle(cairo, 0, (3 * i + 2) * h, w, h);
@@ -100,7 +129,391 @@ static void render_overlay(struct pool_buffer *buffer) {
 	}
 }
 
+/* In verify mode, the expected result of blending the overlay onto the main
+ * pattern is computed on the CPU, both naively (in sRGB) and gamma-correctly
+ * (in linear light). A screenshot of the window can then be compared against
+ * both, without a human having to look at it. */
+static float srgb_to_linear_lut[256];
+static uint8_t linear_to_srgb_lut[LINEAR_LUT_SIZE];
+// Indexed by alpha then premultiplied channel
+static uint8_t unpremultiply_lut[256][256];
+
+static void init_luts(void) {
+	for (int i = 0; i < 256; i++) {
+		double c = i / 255.0;
+		srgb_to_linear_lut[i] = c <= 0.04045 ?
+			c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+	}
+	for (int i = 0; i < LINEAR_LUT_SIZE; i++) {
+		double l = i / (double)(LINEAR_LUT_SIZE - 1);
+		double c = l <= 0.0031308 ?
+			l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055;
+		linear_to_srgb_lut[i] = lround(c * 255);
+	}
+	for (int a = 1; a < 256; a++) {
+		for (int c = 0; c <= a; c++) {
+			unpremultiply_lut[a][c] = (c * 255 + a / 2) / a;
+		}
+	}
+}
+
+/* Both blenders composite premultiplied ARGB32 src over opaque dst. They are
+ * kept branchless so that the compiler can vectorize them, which it only does
+ * in optimized builds (e.g. meson's --buildtype=release). */
+static void blend_naive(uint32_t *restrict out, const uint32_t *restrict dst,
+		const uint32_t *restrict src, int n) {
+	for (int i = 0; i < n; i++) {
+		uint32_t s = src[i], d = dst[i];
+		uint32_t inv = 255 - (s >> 24);
+		// Two channels at a time, with an exact division by 255
+		uint32_t rb = (d & 0x00FF00FF) * inv + 0x00800080;
+		rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+		uint32_t ag = ((d >> 8) & 0x00FF00FF) * inv + 0x00800080;
+		ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+		out[i] = s + (rb | ag);
+	}
+}
+
+static void blend_linear(uint32_t *restrict out, const uint32_t *restrict dst,
+		const uint32_t *restrict src, int n) {
+	for (int i = 0; i < n; i++) {
+		uint32_t s = src[i], d = dst[i];
+		uint32_t a8 = s >> 24;
+		float a = a8 / 255.0f;
+		uint32_t px = 0xFF000000;
+		for (int shift = 0; shift < 24; shift += 8) {
+			float sl = srgb_to_linear_lut[unpremultiply_lut[a8][(s >> shift) & 0xFF]];
+			float dl = srgb_to_linear_lut[(d >> shift) & 0xFF];
+			float l = sl * a + dl * (1 - a);
+			int index = l * (LINEAR_LUT_SIZE - 1) + 0.5f;
+			px |= (uint32_t)linear_to_srgb_lut[index] << shift;
+		}
+		out[i] = px;
+	}
+}
+
+typedef void (*blend_func)(uint32_t *restrict out, const uint32_t *restrict dst,
+	const uint32_t *restrict src, int n);
+
+/* Blends the whole surface a few times, and returns the throughput in pixels
+ * per second */
+static double blend_surface(blend_func blend, cairo_surface_t *out,
+		cairo_surface_t *dst, cairo_surface_t *src) {
+	int width = cairo_image_surface_get_width(out);
+	int height = cairo_image_surface_get_height(out);
+	int stride = cairo_image_surface_get_stride(out);
+	unsigned char *out_data = cairo_image_surface_get_data(out);
+	unsigned char *dst_data = cairo_image_surface_get_data(dst);
+	unsigned char *src_data = cairo_image_surface_get_data(src);
+
+	cairo_surface_flush(out);
+	uint64_t start = get_time_ns();
+	for (int i = 0; i < VERIFY_ITERATIONS; i++) {
+		for (int y = 0; y < height; y++) {
+			blend((uint32_t *)(out_data + y * stride),
+				(const uint32_t *)(dst_data + y * stride),
+				(const uint32_t *)(src_data + y * stride), width);
+		}
+	}
+	uint64_t elapsed = get_time_ns() - start;
+	cairo_surface_mark_dirty(out);
+
+	return (double)width * height * VERIFY_ITERATIONS / (elapsed / 1e9);
+}
+
+struct blend_error {
+	double mean;
+	int max;
+};
+
+/* Compares the color channels of two surfaces of the same size. Alpha is
+ * ignored, since screenshots may not have any. */
+static struct blend_error compare_surfaces(cairo_surface_t *a,
+		cairo_surface_t *b) {
+	int width = cairo_image_surface_get_width(a);
+	int height = cairo_image_surface_get_height(a);
+	int a_stride = cairo_image_surface_get_stride(a);
+	int b_stride = cairo_image_surface_get_stride(b);
+	unsigned char *a_data = cairo_image_surface_get_data(a);
+	unsigned char *b_data = cairo_image_surface_get_data(b);
+
+	struct blend_error error = {0};
+	uint64_t sum = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t *a_row = (const uint32_t *)(a_data + y * a_stride);
+		const uint32_t *b_row = (const uint32_t *)(b_data + y * b_stride);
+		for (int x = 0; x < width; x++) {
+			for (int shift = 0; shift < 24; shift += 8) {
+				int diff = abs((int)((a_row[x] >> shift) & 0xFF) -
+					(int)((b_row[x] >> shift) & 0xFF));
+				sum += diff;
+				if (diff > error.max) {
+					error.max = diff;
+				}
+			}
+		}
+	}
+	error.mean = (double)sum / ((uint64_t)width * height * 3);
+	return error;
+}
+
+static cairo_surface_t *render_pattern(void (*render)(cairo_t *, int, int),
+		int width, int height) {
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_t *cairo = cairo_create(surface);
+	render(cairo, width, height);
+	cairo_destroy(cairo);
+	cairo_surface_flush(surface);
+	return surface;
+}
+
+static int run_verify(int argc, char *argv[]) {
+	int width = WIDTH, height = HEIGHT;
+	cairo_surface_t *screenshot = NULL;
+	if (argc > 2 && sscanf(argv[2], "%dx%d", &width, &height) != 2) {
+		screenshot = cairo_image_surface_create_from_png(argv[2]);
+		if (cairo_surface_status(screenshot) != CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "failed to load %s: %s\n", argv[2],
+				cairo_status_to_string(cairo_surface_status(screenshot)));
+			return EXIT_FAILURE;
+		}
+		width = cairo_image_surface_get_width(screenshot);
+		height = cairo_image_surface_get_height(screenshot);
+	}
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr, "Usage: %s verify [WIDTHxHEIGHT|screenshot.png]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	init_luts();
+	cairo_surface_t *main_surface = render_pattern(render_main, width, height);
+	cairo_surface_t *overlay_surface =
+		render_pattern(render_overlay, width, height);
+
+	cairo_surface_t *naive =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_surface_t *linear =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	double naive_rate =
+		blend_surface(blend_naive, naive, main_surface, overlay_surface);
+	double linear_rate =
+		blend_surface(blend_linear, linear, main_surface, overlay_surface);
+#ifdef __OPTIMIZE__
+	const char *build = "optimized";
+#else
+	const char *build = "unoptimized, rebuild with --buildtype=release";
+#endif
+	printf("%dx%d: naive blend %.1f Mpx/s, gamma-correct blend %.1f Mpx/s "
+		"(%s build)\n", width, height, naive_rate / 1e6, linear_rate / 1e6,
+		build);
+
+	struct blend_error diff = compare_surfaces(naive, linear);
+	printf("naive vs gamma-correct: mean error %.3f, max error %d\n",
+		diff.mean, diff.max);
+
+	int ret = EXIT_SUCCESS;
+	if (screenshot != NULL) {
+		struct blend_error naive_error = compare_surfaces(screenshot, naive);
+		struct blend_error linear_error = compare_surfaces(screenshot, linear);
+		printf("screenshot vs naive: mean error %.3f, max error %d\n",
+			naive_error.mean, naive_error.max);
+		printf("screenshot vs gamma-correct: mean error %.3f, max error %d\n",
+			linear_error.mean, linear_error.max);
+
+		if (linear_error.mean <= VERIFY_TOLERANCE) {
+			printf("compositor blending is gamma-correct\n");
+		} else if (naive_error.mean <= VERIFY_TOLERANCE) {
+			printf("compositor blending is naive\n");
+			ret = EXIT_FAILURE;
+		} else {
+			printf("screenshot matches neither, is it cropped to the window "
+				"and taken at scale 1?\n");
+			ret = EXIT_FAILURE;
+		}
+		cairo_surface_destroy(screenshot);
+	}
+
+	cairo_surface_destroy(linear);
+	cairo_surface_destroy(naive);
+	cairo_surface_destroy(overlay_surface);
+	cairo_surface_destroy(main_surface);
+	return ret;
+}
+
+static void overdraw_add_layer(void) {
+	struct overdraw_layer *layer = &overdraw.layers[overdraw.nlayers];
+	surface_init(&layer->surface);
+	layer->surface.width = layer->surface.height = overdraw.size;
+
+	// Spread the hues around, so that the layers can be told apart
+	double hue = overdraw.nlayers * 2.399;
+	layer->surface.color[0] = 0.5 + 0.5 * cos(hue);
+	layer->surface.color[1] = 0.5 + 0.5 * cos(hue + 2.094);
+	layer->surface.color[2] = 0.5 + 0.5 * cos(hue + 4.189);
+
+	struct wl_surface *below = overdraw.nlayers == 0 ?
+		overdraw.toplevel.surface.wl_surface :
+		overdraw.layers[overdraw.nlayers - 1].surface.wl_surface;
+	layer->subsurface = wl_subcompositor_get_subsurface(subcompositor,
+		layer->surface.wl_surface, overdraw.toplevel.surface.wl_surface);
+	wl_subsurface_place_above(layer->subsurface, below);
+	overdraw.nlayers++;
+}
+
+static void overdraw_feedback_handle_presented(void *data,
+		struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	uint64_t *commit_time = data;
+	wp_presentation_feedback_destroy(feedback);
+
+	uint64_t presented = timespec_to_ns(tv_sec_hi, tv_sec_lo, tv_nsec);
+	if (presented > *commit_time) {
+		latency_stats_add(&overdraw.latency, presented - *commit_time);
+	}
+	overdraw.presented++;
+	free(commit_time);
+}
+
+static void overdraw_feedback_handle_discarded(void *data,
+		struct wp_presentation_feedback *feedback) {
+	wp_presentation_feedback_destroy(feedback);
+	overdraw.discarded++;
+	free(data);
+}
+
+static const struct wp_presentation_feedback_listener overdraw_feedback_listener = {
+	.sync_output = noop,
+	.presented = overdraw_feedback_handle_presented,
+	.discarded = overdraw_feedback_handle_discarded,
+};
+
+/* Prints a CSV row for the current layer count, and adds layers. Returns
+ * false once the maximum has been measured. */
+static bool overdraw_step(void) {
+	uint64_t now = get_time_ns();
+	double elapsed = (now - overdraw.step_start) / 1e9;
+	printf("%d,%d,%.1f,%.1f,%.1f,%d\n", overdraw.nlayers, overdraw.size,
+		overdraw.frames / elapsed,
+		latency_stats_percentile(&overdraw.latency, 50) / 1e3,
+		latency_stats_percentile(&overdraw.latency, 99) / 1e3,
+		overdraw.discarded);
+	fflush(stdout);
+
+	if (overdraw.nlayers >= overdraw.max_layers) {
+		return false;
+	}
+	int nlayers = 2 * overdraw.nlayers;
+	if (nlayers > overdraw.max_layers) {
+		nlayers = overdraw.max_layers;
+	}
+	while (overdraw.nlayers < nlayers) {
+		overdraw_add_layer();
+	}
+
+	overdraw.step_start = now;
+	overdraw.frames = overdraw.presented = overdraw.discarded = 0;
+	latency_stats_reset(&overdraw.latency);
+	return true;
+}
+
+static const struct wl_callback_listener overdraw_frame_listener;
+
+static void overdraw_render(void) {
+	double t = (get_time_ns() - overdraw.start_time) / 1e9;
+	for (int i = 0; i < overdraw.nlayers; i++) {
+		struct wleird_surface *surface = &overdraw.layers[i].surface;
+		// Each layer pulses between 10% and 50% opacity, out of phase
+		surface->color[3] = 0.3 + 0.2 * sin(2 * M_PI * t + i);
+		surface_render(surface);
+	}
+
+	struct wl_surface *main_surface = overdraw.toplevel.surface.wl_surface;
+	struct wl_callback *callback = wl_surface_frame(main_surface);
+	wl_callback_add_listener(callback, &overdraw_frame_listener, NULL);
+	if (presentation != NULL) {
+		uint64_t *commit_time = malloc(sizeof(uint64_t));
+		*commit_time = get_time_ns();
+		struct wp_presentation_feedback *feedback =
+			wp_presentation_feedback(presentation, main_surface);
+		wp_presentation_feedback_add_listener(feedback,
+			&overdraw_feedback_listener, commit_time);
+	}
+	// Layers are synchronized, this applies all of them at once
+	wl_surface_commit(main_surface);
+	overdraw.frames++;
+}
+
+static void overdraw_frame_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time_ms) {
+	wl_callback_destroy(callback);
+
+	if (get_time_ns() - overdraw.step_start >=
+			OVERDRAW_STEP_SECONDS * 1000000000ULL && !overdraw_step()) {
+		exit(EXIT_SUCCESS);
+	}
+	overdraw_render();
+}
+
+static const struct wl_callback_listener overdraw_frame_listener = {
+	.done = overdraw_frame_handle_done,
+};
+
+static int run_overdraw(struct wl_display *display, int argc, char *argv[]) {
+	overdraw.max_layers = OVERDRAW_MAX_LAYERS;
+	overdraw.size = OVERDRAW_SIZE;
+	if (argc > 2) {
+		overdraw.max_layers = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		overdraw.size = atoi(argv[3]);
+	}
+	if (overdraw.max_layers <= 0 || overdraw.max_layers > OVERDRAW_MAX_LAYERS ||
+			overdraw.size <= 0) {
+		fprintf(stderr, "Usage: %s overdraw [max_layers] [size]\n", argv[0]);
+		fprintf(stderr, "max_layers is at most %d, defaults are %d and %d\n",
+			OVERDRAW_MAX_LAYERS, OVERDRAW_MAX_LAYERS, OVERDRAW_SIZE);
+		return EXIT_FAILURE;
+	}
+	if (presentation == NULL) {
+		fprintf(stderr, "compositor doesn't support wp_presentation, "
+			"no presentation latency\n");
+	} else if (presentation_clock_id != CLOCK_MONOTONIC) {
+		fprintf(stderr, "Warning: presentation clock isn't "
+			"CLOCK_MONOTONIC, latency will be off\n");
+	}
+
+	// Keep the configured size, the layers are as big as the window
+	xdg_toplevel_listener.configure = noop;
+	toplevel_init(&overdraw.toplevel);
+	overdraw.toplevel.surface.width = overdraw.size;
+	overdraw.toplevel.surface.height = overdraw.size;
+	float white[4] = {1, 1, 1, 1};
+	memcpy(overdraw.toplevel.surface.color, white, sizeof(float[4]));
+
+	// Wait for the first configure, which maps the window
+	wl_display_roundtrip(display);
+
+	printf("layers,size,fps,latency_p50_us,latency_p99_us,discarded\n");
+	overdraw_add_layer();
+	overdraw.start_time = overdraw.step_start = get_time_ns();
+	overdraw_render();
+
+	while (wl_display_dispatch(display) != -1) {
+		// This space intentionally left blank
+	}
+
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
+	if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+		// Doesn't need a compositor
+		return run_verify(argc, argv);
+	}
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
@@ -119,6 +532,19 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	// The window size can be picked to match a verify run. Its buffers are
+	// scale 1, so screenshots to verify must be taken on a scale 1 output.
+	int width = WIDTH, height = HEIGHT;
+	if (argc > 1 && strcmp(argv[1], "overdraw") == 0) {
+		return run_overdraw(display, argc, argv);
+	} else if (argc > 2 || (argc > 1 &&
+			(sscanf(argv[1], "%dx%d", &width, &height) != 2 ||
+			width <= 0 || height <= 0))) {
+		fprintf(stderr, "Usage: %s [WIDTHxHEIGHT|overdraw [max_layers] [size]|"
+			"verify [WIDTHxHEIGHT|screenshot.png]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	struct wl_surface *main_surface = wl_compositor_create_surface(compositor);
 	struct wl_surface *overlay_surface = wl_compositor_create_surface(compositor);
 
@@ -135,13 +561,14 @@ int main(int argc, char *argv[]) {
 	wl_subcompositor_get_subsurface(subcompositor, overlay_surface, main_surface);
 
 	struct pool_buffer main_buffer = {0};
-	create_buffer(shm, &main_buffer, 400, 400);
+	create_buffer(shm, &main_buffer, width, height);
 
 	struct pool_buffer overlay_buffer = {0};
 	create_buffer(shm, &overlay_buffer, main_buffer.width, main_buffer.height);
 
-	render_main(&main_buffer);
-	render_overlay(&overlay_buffer);
+	render_main(main_buffer.cairo, main_buffer.width, main_buffer.height);
+	render_overlay(overlay_buffer.cairo, overlay_buffer.width,
+		overlay_buffer.height);
 
 	wl_surface_attach(overlay_surface, overlay_buffer.buffer, 0, 0);
 	wl_surface_damage_buffer(overlay_surface, 0, 0, INT32_MAX, INT32_MAX);
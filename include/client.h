@@ -1,6 +1,7 @@
 #ifndef _CLIENT_H
 #define _CLIENT_H
 
+#include <stdbool.h>
 #include <wayland-client-protocol.h>
 #ifdef __linux__
 #include <linux/input-event-codes.h>
@@ -8,16 +9,39 @@
 #include <dev/evdev/input-event-codes.h>
 #endif
 #include "pool-buffer.h"
+#include "presentation-time-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 
 extern struct wl_shm *shm;
 extern struct wl_compositor *compositor;
 extern struct xdg_wm_base *wm_base;
 extern struct wl_data_device_manager *data_device_manager;
+extern struct wp_presentation *presentation;
+extern uint32_t presentation_clock_id;
+extern struct wp_viewporter *viewporter;
+extern struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
 extern struct wl_seat *seat;
 
 extern struct wl_pointer *pointer;
 
+/* Opaque regions can be turned off for all surfaces by setting WLEIRD_OPAQUE
+ * to 0, to compare the compositor's work with and without them. */
+extern bool opaque_regions;
+
+enum wleird_opaque {
+	WLEIRD_OPAQUE_AUTO = 0, // opaque if the fill color is
+	WLEIRD_OPAQUE_NEVER,
+	WLEIRD_OPAQUE_ALWAYS, // even if the fill color isn't
+};
+
+struct single_pixel_buffer {
+	struct wl_buffer *buffer;
+	float color[4];
+	bool busy;
+};
+
 struct wleird_surface {
 	struct wl_surface *wl_surface;
 
@@ -26,6 +50,16 @@ struct wleird_surface {
 
 	int attach_x, attach_y;
 	float color[4];
+
+	enum wleird_opaque opaque;
+	bool opaque_region; // whether an opaque region is currently set
+
+	/* If set, the surface is filled with a single-pixel buffer scaled with a
+	 * viewport instead of a shm buffer. Requires single_pixel_buffer_manager
+	 * and viewporter. */
+	bool single_pixel;
+	struct single_pixel_buffer single_pixel_buffers[2];
+	struct wp_viewport *viewport;
 };
 
 struct wleird_toplevel {
@@ -42,8 +76,18 @@ void noop();
 
 void registry_init(struct wl_display *display);
 
+/* Flushes the requests queued so far, waiting for the compositor to make room
+ * in the socket rather than giving up on EAGAIN. Clients queueing a lot of
+ * requests at once should call this every now and then: before libwayland
+ * 1.23, running out of room while queueing is fatal. Returns false if the
+ * connection broke. */
+bool display_flush_blocking(struct wl_display *display);
+
 void surface_init(struct wleird_surface *surface);
-void surface_render(struct wleird_surface *surface);
+void surface_attach(struct wleird_surface *surface,
+	struct pool_buffer *buffer);
+// Returns false if no buffer was available, in which case nothing is committed
+bool surface_render(struct wleird_surface *surface);
 
 void toplevel_init(struct wleird_toplevel *toplevel);
 
@@ -16,9 +16,15 @@ struct pool_buffer {
 	void *data;
 	size_t size;
 	bool busy;
+	// Called when the compositor releases the buffer, if set. This is
+	// kept across reallocations.
+	void (*release)(struct pool_buffer *buf, void *data);
+	void *release_data;
 };
 
 int create_pool_file(size_t size);
+// Creates a memfd of the given size, sealed with the given F_SEAL_* flags
+int create_memfd_pool_file(size_t size, unsigned int seals);
 struct pool_buffer *create_buffer(struct wl_shm *shm,
 	struct pool_buffer *buf, int32_t width, int32_t height);
 struct pool_buffer *get_next_buffer(struct wl_shm *shm,
@@ -0,0 +1,44 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <wayland-client.h>
+
+struct latency_stats {
+	uint64_t *samples; // in nanoseconds
+	size_t len, cap;
+};
+
+uint64_t get_time_ns(void);
+uint64_t timespec_to_ns(uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+	uint32_t tv_nsec);
+
+void latency_stats_add(struct latency_stats *stats, uint64_t ns);
+void latency_stats_print(struct latency_stats *stats, const char *name);
+// Returns the given percentile of the samples, or 0 if there are none
+uint64_t latency_stats_percentile(struct latency_stats *stats, double pct);
+void latency_stats_print_histogram(struct latency_stats *stats,
+	const char *name);
+void latency_stats_reset(struct latency_stats *stats);
+void latency_stats_finish(struct latency_stats *stats);
+
+struct process_usage {
+	uint64_t rss, pss; // in bytes
+	int fds, maps;
+};
+
+// Returns the pid of the compositor on the other end of the socket, or -1
+pid_t get_compositor_pid(struct wl_display *display);
+// Returns the user + system CPU time consumed by a process, in nanoseconds
+uint64_t get_process_cpu_time(pid_t pid);
+// Returns the resident set size of a process, in bytes
+uint64_t get_process_rss(pid_t pid);
+// Returns the number of file descriptors a process has open
+int get_process_fd_count(pid_t pid);
+// Samples memory, file descriptor and mapping usage of a process from /proc
+bool get_process_usage(pid_t pid, struct process_usage *usage);
+
+#endif
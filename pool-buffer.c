@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <cairo/cairo.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -62,9 +62,31 @@ int create_pool_file(size_t size) {
 	return fd;
 }
 
+int create_memfd_pool_file(size_t size, unsigned int seals) {
+	int fd = memfd_create("wleird", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (seals != 0 && fcntl(fd, F_ADD_SEALS, seals) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 static void buffer_handle_release(void *data, struct wl_buffer *wl_buffer) {
 	struct pool_buffer *buffer = data;
 	buffer->busy = false;
+	if (buffer->release) {
+		buffer->release(buffer, buffer->release_data);
+	}
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -169,7 +191,11 @@ void finish_buffer(struct pool_buffer *buf) {
 		munmap(buf->data, buf->size);
 	}
 	close(buf->poolfd);
+	void (*release)(struct pool_buffer *buf, void *data) = buf->release;
+	void *release_data = buf->release_data;
 	memset(buf, 0, sizeof(struct pool_buffer));
+	buf->release = release;
+	buf->release_data = release_data;
 }
 
 struct pool_buffer *get_next_buffer(struct wl_shm *shm,
@@ -0,0 +1,286 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "client.h"
+#include "stats.h"
+
+#define SIZE 1024
+#define MAX_RECTS 100000
+#define LIMIT 1000000
+#define REPEATS 8
+#define RANDOM_MAX_RECT 64
+#define RING_STEP 4
+#define RING_WIDTH 2
+#define BAND_RECTS 256
+#define FLUSH_BATCH 1000
+
+static struct wl_display *display = NULL;
+static int queued_rects = 0;
+static uint64_t flush_time = 0;
+static bool flush_failed = false;
+
+/* Large regions are several megabytes of requests, more than the socket
+ * buffer can hold, so they are sent every FLUSH_BATCH rects. The time spent
+ * waiting for the compositor to read them is kept apart from the build. */
+static void region_add(struct wl_region *region, int x, int y, int w, int h) {
+	wl_region_add(region, x, y, w, h);
+	if (++queued_rects % FLUSH_BATCH != 0 || flush_failed) {
+		return;
+	}
+	uint64_t start = get_time_ns();
+	if (!display_flush_blocking(display)) {
+		flush_failed = true;
+	}
+	flush_time += get_time_ns() - start;
+}
+
+/* Shape generators add n rectangles inside a size x size area. seed changes
+ * the shape slightly, so that the compositor can't reuse the previous one. */
+typedef void (*generator_func)(struct wl_region *region, int n, int size,
+	int seed);
+
+static void gen_checkerboard(struct wl_region *region, int n, int size,
+		int seed) {
+	// Half of the cells of a cols x cols grid are filled
+	int cols = (int)ceil(sqrt(2.0 * n));
+	int cell = size / cols > 0 ? size / cols : 1;
+	int added = 0;
+	for (int i = 0; added < n; i++) {
+		int x = i % cols, y = i / cols;
+		if ((x + y + seed) % 2 == 0) {
+			region_add(region, x * cell, y * cell, cell, cell);
+			added++;
+		}
+	}
+}
+
+static void gen_staircase(struct wl_region *region, int n, int size,
+		int seed) {
+	// One step per row, each one wider than the previous
+	for (int i = 0; i < n; i++) {
+		region_add(region, 0, i, 1 + (i + seed) % size, 1);
+	}
+}
+
+static void gen_rings(struct wl_region *region, int n, int size, int seed) {
+	// Concentric rings, each made of one or two spans per row
+	int center = size / 2;
+	int added = 0;
+	for (int outer = RING_WIDTH + seed % RING_STEP; added < n;
+			outer += RING_STEP) {
+		int inner = outer - RING_WIDTH;
+		for (int dy = -outer; dy <= outer && added < n; dy++) {
+			int xo = (int)sqrt((double)outer * outer - dy * dy);
+			int y = center + dy;
+			if (abs(dy) >= inner) {
+				region_add(region, center - xo, y, 2 * xo + 1, 1);
+				added++;
+				continue;
+			}
+			int xi = (int)sqrt((double)inner * inner - dy * dy);
+			region_add(region, center - xo, y, xo - xi, 1);
+			region_add(region, center + xi + 1, y, xo - xi, 1);
+			added += 2;
+		}
+	}
+}
+
+static void gen_random(struct wl_region *region, int n, int size, int seed) {
+	srand(seed);
+	for (int i = 0; i < n; i++) {
+		region_add(region, rand() % size, rand() % size,
+			1 + rand() % RANDOM_MAX_RECT, 1 + rand() % RANDOM_MAX_RECT);
+	}
+}
+
+static void gen_banded(struct wl_region *region, int n, int size, int seed) {
+	// Bands of BAND_RECTS small rects on the same rows, with gaps in between
+	for (int i = 0; i < n; i++) {
+		int band = i / BAND_RECTS, col = i % BAND_RECTS;
+		region_add(region, 2 * col + seed % 2, 3 * band, 1, 2);
+	}
+}
+
+static const struct {
+	const char *name;
+	generator_func func;
+} generators[] = {
+	{"checkerboard", gen_checkerboard},
+	{"staircase", gen_staircase},
+	{"rings", gen_rings},
+	{"random", gen_random},
+	{"banded", gen_banded},
+	{NULL, NULL},
+};
+
+static struct wleird_toplevel toplevel = {0};
+static bool frame_done = false;
+static uint64_t frame_time = 0;
+
+static void frame_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time_ms) {
+	wl_callback_destroy(callback);
+	frame_time = get_time_ns();
+	frame_done = true;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+static void xdg_toplevel_handle_configure(void *data,
+		struct xdg_toplevel *xdg_toplevel, int32_t w, int32_t h,
+		struct wl_array *states) {
+	// Keep the size fixed, so that every shape fits
+}
+
+/* Builds a region with n rects, uses it as the input and opaque region, and
+ * times each step */
+static bool measure(generator_func gen, int n, int seed,
+		struct latency_stats stats[static 4]) {
+	queued_rects = 0;
+	flush_time = 0;
+	uint64_t start = get_time_ns();
+	struct wl_region *region = wl_compositor_create_region(compositor);
+	gen(region, n, SIZE, seed);
+	if (flush_failed) {
+		return false;
+	}
+	latency_stats_add(&stats[0], get_time_ns() - start - flush_time);
+
+	// The compositor builds the region as the requests come in
+	start = get_time_ns();
+	if (wl_display_roundtrip(display) == -1) {
+		return false;
+	}
+	latency_stats_add(&stats[1], get_time_ns() - start + flush_time);
+
+	struct wleird_surface *surface = &toplevel.surface;
+	wl_surface_set_input_region(surface->wl_surface, region);
+	wl_surface_set_opaque_region(surface->wl_surface, region);
+	wl_region_destroy(region);
+
+	struct wl_callback *callback = wl_surface_frame(surface->wl_surface);
+	wl_callback_add_listener(callback, &frame_listener, NULL);
+	frame_done = false;
+	start = get_time_ns();
+	bool rendered = surface_render(surface);
+	if (!rendered) {
+		// Still apply the regions, but this frame won't be comparable
+		wl_callback_destroy(callback);
+		wl_surface_commit(surface->wl_surface);
+	}
+	if (wl_display_roundtrip(display) == -1) {
+		return false;
+	}
+	latency_stats_add(&stats[2], get_time_ns() - start);
+
+	if (!rendered) {
+		fprintf(stderr, "no free buffer at %d rects, skipping frame sample\n",
+			n);
+		return true;
+	}
+	while (!frame_done) {
+		if (wl_display_dispatch(display) == -1) {
+			return false;
+		}
+	}
+	latency_stats_add(&stats[3], frame_time - start);
+	return true;
+}
+
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [shape] [max_rects]\n", bin);
+	fprintf(stderr, "shapes:");
+	for (int i = 0; generators[i].name; i++) {
+		fprintf(stderr, " %s", generators[i].name);
+	}
+	fprintf(stderr, "\ndefaults are random and %d rects (up to %d)\n",
+		MAX_RECTS, LIMIT);
+	fprintf(stderr, "Prints a CSV of median build, region roundtrip, "
+		"commit roundtrip and frame latency per rect count, "
+		"in microseconds\n");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 3) {
+		return usage(argv[0]);
+	}
+
+	const char *shape = "random";
+	generator_func gen = gen_random;
+	if (argc > 1) {
+		gen = NULL;
+		for (int i = 0; generators[i].name; i++) {
+			if (!strcmp(generators[i].name, argv[1])) {
+				shape = generators[i].name;
+				gen = generators[i].func;
+				break;
+			}
+		}
+		if (gen == NULL) {
+			return usage(argv[0]);
+		}
+	}
+	int max_rects = MAX_RECTS;
+	if (argc > 2) {
+		max_rects = atoi(argv[2]);
+		if (max_rects <= 0 || max_rects > LIMIT) {
+			return usage(argv[0]);
+		}
+	}
+
+	display = wl_display_connect(NULL);
+	if (display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		return EXIT_FAILURE;
+	}
+
+	xdg_toplevel_listener.configure = xdg_toplevel_handle_configure;
+
+	registry_init(display);
+	toplevel_init(&toplevel);
+	toplevel.surface.width = toplevel.surface.height = SIZE;
+	// The opaque region is the one under test, don't let it be replaced
+	toplevel.surface.opaque = WLEIRD_OPAQUE_NEVER;
+
+	float color[4] = {0, 0.5, 0, 1};
+	memcpy(toplevel.surface.color, color, sizeof(float[4]));
+
+	// Wait for the first configure, which maps the window
+	wl_display_roundtrip(display);
+
+	printf("shape,rects,build_us,region_us,commit_us,frame_us\n");
+
+	struct latency_stats stats[4] = {0};
+	int seed = 0;
+	for (int n = 1; ; n = n * 2 < max_rects ? n * 2 : max_rects) {
+		for (int i = 0; i < REPEATS; i++) {
+			if (!measure(gen, n, seed++, stats)) {
+				fprintf(stderr, "connection broke at %d rects\n", n);
+				return EXIT_FAILURE;
+			}
+		}
+
+		printf("%s,%d", shape, n);
+		for (size_t i = 0; i < 4; i++) {
+			printf(",%.1f", stats[i].len == 0 ? NAN :
+				latency_stats_percentile(&stats[i], 50) / 1e3);
+			latency_stats_reset(&stats[i]);
+		}
+		printf("\n");
+		fflush(stdout);
+
+		if (n == max_rects) {
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < 4; i++) {
+		latency_stats_finish(&stats[i]);
+	}
+	return EXIT_SUCCESS;
+}
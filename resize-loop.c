@@ -3,15 +3,147 @@
 #include <stdlib.h>
 #include <string.h>
 #include "client.h"
+#include "stats.h"
 
 #define MIN 2
 #define MAX 512
 #define SPEED 10
+#define LIMIT 8192
+
+enum pattern {
+	PATTERN_PINGPONG,
+	PATTERN_LINEAR,
+	PATTERN_RANDOM,
+	PATTERN_STRIDE,
+	PATTERN_UNKNOWN
+};
+
+static const struct {
+	enum pattern pat;
+	const char *desc;
+} options[] = {
+	{PATTERN_PINGPONG, "pingpong"},
+	{PATTERN_LINEAR, "linear"},
+	{PATTERN_RANDOM, "random"},
+	{PATTERN_STRIDE, "stride"},
+	{PATTERN_UNKNOWN, NULL},
+};
+
+/* Each step is printed as a CSV row once its buffer has been released by the
+ * compositor, since that's when the release latency is known. */
+struct step {
+	int index;
+	int size;
+	const char *kind;
+	uint64_t alloc_time;
+	uint64_t commit_time;
+};
+
+static enum pattern pattern = PATTERN_PINGPONG;
+static int min = MIN, max = MAX, speed = SPEED;
 static int size = MIN;
+static int step_index = 0;
+static struct step pending_steps[2] = {0};
 
 static struct wleird_toplevel toplevel = {0};
 static const struct wl_callback_listener callback_listener;
 
+static void next_size(void) {
+	switch (pattern) {
+	case PATTERN_PINGPONG:
+		size += speed;
+		// Shrinking ends at min, even when it lands exactly on 0
+		if (size <= 0 && size > -min) {
+			size = min;
+		} else if (size > 0 && size > max) {
+			size = -max;
+		}
+		break;
+	case PATTERN_LINEAR:
+		size += speed;
+		if (size > max) {
+			size = min;
+		}
+		break;
+	case PATTERN_RANDOM:
+		size = min + rand() % (max - min + 1);
+		break;
+	case PATTERN_STRIDE:
+		// Alternate between both ends of the range, converging towards
+		// the middle, so that every step changes the stride a lot
+		if (step_index % 2 == 0) {
+			size = max - (step_index / 2 * speed) % (max - min + 1);
+		} else {
+			size = min + (step_index / 2 * speed) % (max - min + 1);
+		}
+		break;
+	case PATTERN_UNKNOWN:
+		abort();
+	}
+}
+
+static void buffer_handle_release(struct pool_buffer *buffer, void *data) {
+	size_t i = buffer - toplevel.surface.buffers;
+	if (i >= 2 || pending_steps[i].commit_time == 0) {
+		return;
+	}
+
+	struct step *step = &pending_steps[i];
+	printf("%d,%d,%d,%s,%.1f,%.1f\n", step->index, step->size, step->size,
+		step->kind, step->alloc_time / 1000.0,
+		(get_time_ns() - step->commit_time) / 1000.0);
+	fflush(stdout);
+	step->commit_time = 0;
+}
+
+static bool render(void) {
+	struct wleird_surface *surface = &toplevel.surface;
+	surface->width = surface->height = abs(size);
+
+	// Find out which buffer get_next_buffer is about to pick, and how
+	struct pool_buffer *buffer = NULL;
+	for (size_t i = 0; i < 2; i++) {
+		if (!surface->buffers[i].busy) {
+			buffer = &surface->buffers[i];
+		}
+	}
+	if (buffer == NULL) {
+		return false;
+	}
+
+	const char *kind = "reuse";
+	size_t old_size = (size_t)buffer->width * buffer->height;
+	size_t new_size = (size_t)surface->width * surface->height;
+	if (buffer->buffer == NULL) {
+		kind = "create";
+	} else if (old_size > new_size) {
+		kind = "recreate";
+	} else if (old_size < new_size) {
+		kind = "resize";
+	}
+
+	// Time the (re)allocation on its own: surface_render will then get the
+	// very same buffer back without any allocation
+	uint64_t start = get_time_ns();
+	if (get_next_buffer(shm, surface->buffers,
+			surface->width, surface->height) == NULL) {
+		fprintf(stderr, "failed to obtain buffer\n");
+		return false;
+	}
+	uint64_t alloc_time = get_time_ns() - start;
+
+	surface_render(surface);
+
+	pending_steps[buffer - surface->buffers] = (struct step){
+		.index = step_index,
+		.size = surface->width,
+		.kind = kind,
+		.alloc_time = alloc_time,
+		.commit_time = get_time_ns(),
+	};
+	step_index++;
+	return true;
+}
 
 static void request_frame_callback(void) {
 	struct wl_callback *callback = wl_surface_frame(toplevel.surface.wl_surface);
@@ -25,15 +157,8 @@ static void callback_handle_done(void *data, struct wl_callback *callback,
 		wl_callback_destroy(callback);
 	}
 
-	toplevel.surface.width = abs(size);
-	toplevel.surface.height = abs(size);
-	surface_render(&toplevel.surface);
-
-	size += SPEED;
-	if (size < 0 && size > -MIN) {
-		size = MIN;
-	} else if (size > 0 && size > MAX) {
-		size = -MAX;
+	if (render()) {
+		next_size();
 	}
 	request_frame_callback();
 }
@@ -53,7 +178,49 @@ static void xdg_toplevel_handle_configure(void *data,
 	toplevel.surface.height = abs(size);
 }
 
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [pattern] [min] [max] [step]\n", bin);
+	fprintf(stderr, "patterns:");
+	for (int i = 0; options[i].desc; i++) {
+		fprintf(stderr, " %s", options[i].desc);
+	}
+	fprintf(stderr, "\nmin and max are in pixels (up to %d), defaults "
+		"are %d, %d and %d\n", LIMIT, MIN, MAX, SPEED);
+	fprintf(stderr, "Prints a CSV of allocation and release latency "
+		"per step, in microseconds\n");
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
+	if (argc > 5) {
+		return usage(argv[0]);
+	}
+	if (argc > 1) {
+		pattern = PATTERN_UNKNOWN;
+		for (int i = 0; options[i].desc; i++) {
+			if (!strcmp(options[i].desc, argv[1])) {
+				pattern = options[i].pat;
+				break;
+			}
+		}
+		if (pattern == PATTERN_UNKNOWN) {
+			return usage(argv[0]);
+		}
+	}
+	if (argc > 2) {
+		min = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		max = atoi(argv[3]);
+	}
+	if (argc > 4) {
+		speed = atoi(argv[4]);
+	}
+	if (min <= 0 || max < min || max > LIMIT || speed <= 0) {
+		return usage(argv[0]);
+	}
+	size = min;
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
@@ -64,10 +231,15 @@ int main(int argc, char *argv[]) {
 
 	registry_init(display);
 	toplevel_init(&toplevel);
+	for (size_t i = 0; i < 2; i++) {
+		toplevel.surface.buffers[i].release = buffer_handle_release;
+	}
 
 	float color[4] = {1, 0, 0, 1};
 	memcpy(toplevel.surface.color, color, sizeof(float[4]));
 
+	printf("step,width,height,kind,alloc_us,release_us\n");
+
 	request_frame_callback();
 
 	while (wl_display_dispatch(display) != -1) {
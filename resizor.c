@@ -1,14 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "client.h"
+#include "stats.h"
 
 #define MIN_SIZE 50
 #define MAX_SIZE 1000
 
 static struct wleird_toplevel toplevel = {0};
 
+/* By default, every motion event is rendered right away. In coalesce mode,
+ * motion events are accumulated and rendered once per frame callback. Each
+ * frame carries the time of the oldest motion event it reflects, to measure
+ * the motion to presentation latency. */
+static bool coalesce = false;
+static bool frame_pending = false, dirty = false;
+static uint32_t pending_event_time = 0;
+static uint64_t pending_receive_time = 0;
+
+struct frame_input {
+	uint32_t event_time; // ms, from the compositor
+	uint64_t receive_time; // ns, from the client
+	bool rendered; // false if the commit carried no new buffer
+};
+
+static struct latency_stats event_latency = {0};
+static struct latency_stats receive_latency = {0};
+
+static const struct wl_callback_listener callback_listener;
+
 struct {
 	int x, y;
 	int last_x, last_y;
@@ -31,6 +54,93 @@ static void pointer_handle_leave(void *data, struct wl_pointer *wl_pointer,
 	// No-op
 }
 
+static void feedback_handle_presented(void *data,
+		struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	struct frame_input *input = data;
+	wp_presentation_feedback_destroy(feedback);
+	if (!input->rendered) {
+		free(input);
+		return;
+	}
+
+	uint64_t presented = timespec_to_ns(tv_sec_hi, tv_sec_lo, tv_nsec);
+	// Input event times use the same base as the presentation clock in
+	// practice, but with a millisecond granularity and wrapping around
+	uint32_t presented_ms = (uint32_t)(presented / 1000000);
+	latency_stats_add(&event_latency,
+		(uint64_t)(presented_ms - input->event_time) * 1000000);
+	if (presented > input->receive_time) {
+		latency_stats_add(&receive_latency, presented - input->receive_time);
+	}
+	free(input);
+}
+
+static void feedback_handle_discarded(void *data,
+		struct wp_presentation_feedback *feedback) {
+	wp_presentation_feedback_destroy(feedback);
+	free(data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = noop,
+	.presented = feedback_handle_presented,
+	.discarded = feedback_handle_discarded,
+};
+
+static void render(void) {
+	struct frame_input *input = NULL;
+	if (presentation != NULL) {
+		input = calloc(1, sizeof(struct frame_input));
+	}
+	if (input != NULL) {
+		input->event_time = pending_event_time;
+		input->receive_time = pending_receive_time;
+
+		struct wp_presentation_feedback *feedback = wp_presentation_feedback(
+			presentation, toplevel.surface.wl_surface);
+		wp_presentation_feedback_add_listener(feedback, &feedback_listener,
+			input);
+	}
+
+	if (coalesce) {
+		struct wl_callback *callback =
+			wl_surface_frame(toplevel.surface.wl_surface);
+		wl_callback_add_listener(callback, &callback_listener, NULL);
+	}
+
+	bool rendered = surface_render(&toplevel.surface);
+	if (!rendered) {
+		// Both buffers are still held by the compositor. Commit anyway, so
+		// that the frame callback fires and the input is rendered then.
+		wl_surface_commit(toplevel.surface.wl_surface);
+	}
+	if (input != NULL) {
+		input->rendered = rendered;
+	}
+	if (coalesce) {
+		frame_pending = true;
+	}
+	if (rendered) {
+		dirty = false;
+	}
+}
+
+static void callback_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time_ms) {
+	wl_callback_destroy(callback);
+
+	frame_pending = false;
+	if (dirty) {
+		render();
+	}
+}
+
+static const struct wl_callback_listener callback_listener = {
+	.done = callback_handle_done,
+};
+
 static void pointer_handle_motion(void *data, struct wl_pointer *wl_pointer,
 		uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y) {
 	pointer_state.x = wl_fixed_to_int(surface_x);
@@ -59,11 +169,20 @@ static void pointer_handle_motion(void *data, struct wl_pointer *wl_pointer,
 			dheight *= 2;
 		}
 
-		toplevel.surface.attach_x = dx;
-		toplevel.surface.attach_y = dy;
+		// Deltas accumulate until the next render when coalescing
+		toplevel.surface.attach_x += dx;
+		toplevel.surface.attach_y += dy;
 		toplevel.surface.width -= dwidth;
 		toplevel.surface.height -= dheight;
-		surface_render(&toplevel.surface);
+
+		if (!dirty) {
+			pending_event_time = time;
+			pending_receive_time = get_time_ns();
+			dirty = true;
+		}
+		if (!frame_pending) {
+			render();
+		}
 
 		pointer_state.last_x = pointer_state.x - dx;
 		pointer_state.last_y = pointer_state.y - dy;
@@ -80,6 +199,16 @@ static void pointer_handle_button(void *data, struct wl_pointer *wl_pointer,
 			pointer_state.resizing = RESIZING_ANCHORED_TO_CENTER;
 		}
 	} else {
+		if (pointer_state.resizing) {
+			fprintf(stderr, "%s mode:\n",
+				coalesce ? "coalesce" : "immediate");
+			latency_stats_print_histogram(&event_latency,
+				"motion event to presentation");
+			latency_stats_print(&receive_latency,
+				"motion receipt to presentation");
+			latency_stats_reset(&event_latency);
+			latency_stats_reset(&receive_latency);
+		}
 		pointer_state.resizing = RESIZING_NONE;
 	}
 
@@ -96,7 +225,24 @@ static const struct wl_pointer_listener pointer_listener = {
 };
 
 
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [immediate|coalesce]\n", bin);
+	fprintf(stderr, "immediate: render on every motion event (default)\n");
+	fprintf(stderr, "coalesce: render at most once per frame callback\n");
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
+	if (argc > 2) {
+		return usage(argv[0]);
+	} else if (argc == 2) {
+		if (strcmp(argv[1], "coalesce") == 0) {
+			coalesce = true;
+		} else if (strcmp(argv[1], "immediate") != 0) {
+			return usage(argv[0]);
+		}
+	}
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
@@ -105,6 +251,14 @@ int main(int argc, char *argv[]) {
 
 	registry_init(display);
 
+	if (presentation == NULL) {
+		fprintf(stderr, "compositor doesn't support wp_presentation, "
+			"latency won't be measured\n");
+	} else if (presentation_clock_id != CLOCK_MONOTONIC) {
+		fprintf(stderr, "Warning: presentation clock isn't "
+			"CLOCK_MONOTONIC, latency will be wrong\n");
+	}
+
 	if (pointer != NULL) {
 		wl_pointer_add_listener(pointer, &pointer_listener, NULL);
 	}
@@ -1,23 +1,45 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_GBM
 #include <gbm.h>
+#endif
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#ifdef HAVE_UDMABUF
+#include <linux/udmabuf.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <wayland-client-protocol.h>
 
+#include "client.h"
 #include "pool-buffer.h"
+#include "stats.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "xdg-shell-client-protocol.h"
 
 #define POOL_SIZE 1024
 #define POINTS_PER_REGION 300
 #define DMABUF_WIDTH 64
 #define DMABUF_HEIGHT 64
-#define DMABUF_FORMAT GBM_FORMAT_XRGB8888
+#define DMABUF_FORMAT 0x34325258 // DRM_FORMAT_XRGB8888
+#define DMABUF_SIZE (DMABUF_WIDTH * DMABUF_HEIGHT * 4)
+#define MAX_THREADS 256
+#define SUBSURFACE_TREE_ARITY 4
+#define PROBE_INTERVAL_MS 10
+/* Objects queued between two flushes within a batch */
+#define FLUSH_BATCH 256
 
 static void handle_sigint(int sig) {
 	(void)sig;
@@ -28,9 +50,18 @@ enum mode {
 	CONSUME_NOOP,
 	CONSUME_SHMPOOL,
 	CONSUME_REGION,
-	CONSUME_DMABUF
+	CONSUME_DMABUF,
+	CONSUME_SURFACE,
+	CONSUME_SUBSURFACE,
+	CONSUME_CALLBACK,
+	CONSUME_POSITIONER,
+	CONSUME_BUFFER
 };
 
+/* Number of objects created between two roundtrips, which check whether the
+ * connection broke */
+static uint32_t batch_size = 1;
+
 struct connection {
 	struct wl_list link;
 	uint32_t resource_count;
@@ -38,12 +69,40 @@ struct connection {
 	struct wl_registry *registry;
 	struct wl_shm *shm;
 	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
+	struct xdg_wm_base *wm_base;
 	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
 	struct wl_shm_pool **pools;
 	struct wl_region **regions;
 	struct wl_buffer **buffers;
+	struct wl_surface **surfaces;
+	struct wl_subsurface **subsurfaces;
+	struct wl_callback **callbacks;
+	struct xdg_positioner **positioners;
+	/* the single surface or pool all objects are created from, in the
+	 * callback and buffer modes */
+	struct wl_surface *surface;
+	struct wl_shm_pool *pool;
+	/* time spent in roundtrips, to see the compositor slow down */
+	uint64_t sync_time;
+	uint32_t syncs;
+	bool import_failed;
+	/* dmabuf imports queued since the last roundtrip */
+	struct wl_list queued_imports;
+};
+
+/* dmabufs are imported asynchronously, to time each import from the flush
+ * that sends it up to the created event */
+struct dmabuf_import {
+	struct connection *conn;
+	struct wl_list link;
+	uint32_t index;
+	uint64_t start;
 };
 
+static pthread_mutex_t import_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_stats import_latency = {0};
+
 void destroy_connection(struct connection *conn) {
 	if (!conn) {
 		return;
@@ -62,6 +121,41 @@ void destroy_connection(struct connection *conn) {
 			}
 		}
 	}
+	if (conn->callbacks) {
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			if (conn->callbacks[i]) {
+				wl_callback_destroy(conn->callbacks[i]);
+			}
+		}
+	}
+	if (conn->positioners) {
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			if (conn->positioners[i]) {
+				xdg_positioner_destroy(conn->positioners[i]);
+			}
+		}
+	}
+	if (conn->subsurfaces) {
+		/* children first */
+		for (uint32_t i = conn->resource_count; i > 0; i--) {
+			if (conn->subsurfaces[i - 1]) {
+				wl_subsurface_destroy(conn->subsurfaces[i - 1]);
+			}
+		}
+	}
+	if (conn->surfaces) {
+		for (uint32_t i = conn->resource_count + 1; i > 0; i--) {
+			if (conn->surfaces[i - 1]) {
+				wl_surface_destroy(conn->surfaces[i - 1]);
+			}
+		}
+	}
+	if (conn->surface) {
+		wl_surface_destroy(conn->surface);
+	}
+	if (conn->pool) {
+		wl_shm_pool_destroy(conn->pool);
+	}
 	if (conn->regions) {
 		for (uint32_t i = 0; i < (conn->resource_count / POINTS_PER_REGION + 1); i++) {
 			if (conn->regions[i]) {
@@ -75,6 +169,12 @@ void destroy_connection(struct connection *conn) {
 	if (conn->compositor) {
 		wl_compositor_destroy(conn->compositor);
 	}
+	if (conn->subcompositor) {
+		wl_subcompositor_destroy(conn->subcompositor);
+	}
+	if (conn->wm_base) {
+		xdg_wm_base_destroy(conn->wm_base);
+	}
 	if (conn->linux_dmabuf) {
 		zwp_linux_dmabuf_v1_destroy(conn->linux_dmabuf);
 	}
@@ -85,10 +185,25 @@ void destroy_connection(struct connection *conn) {
 		wl_display_disconnect(conn->display);
 	}
 	free(conn->pools);
+	free(conn->regions);
+	free(conn->buffers);
+	free(conn->surfaces);
+	free(conn->subsurfaces);
+	free(conn->callbacks);
+	free(conn->positioners);
 	free(conn);
 }
 
 
+static void wm_base_handle_ping(void *data, struct xdg_wm_base *xdg_wm_base,
+		uint32_t serial) {
+	xdg_wm_base_pong(xdg_wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	.ping = wm_base_handle_ping,
+};
+
 static void reg_global(void *data, struct wl_registry *wl_registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct connection *conn = data;
@@ -98,6 +213,13 @@ static void reg_global(void *data, struct wl_registry *wl_registry,
 	} else if (strcmp(interface, wl_compositor_interface.name) == 0) {
 		conn->compositor = wl_registry_bind(wl_registry, name,
 			&wl_compositor_interface, 1);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		conn->subcompositor = wl_registry_bind(wl_registry, name,
+			&wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		conn->wm_base = wl_registry_bind(wl_registry, name,
+			&xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(conn->wm_base, &wm_base_listener, NULL);
 	} else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0
 			&& version >= 2) {
 		conn->linux_dmabuf = wl_registry_bind(wl_registry, name,
@@ -115,6 +237,90 @@ static const struct wl_registry_listener reg_listener = {
 	.global_remove = &reg_global_remove,
 };
 
+/* Roundtrips after the last object of each batch, and after the very last
+ * object */
+static int timed_roundtrip(struct connection *conn) {
+	uint64_t start = get_time_ns();
+	int ret = wl_display_roundtrip(conn->display);
+	conn->sync_time += get_time_ns() - start;
+	conn->syncs++;
+	return ret;
+}
+
+/* The queued imports only leave the client with the next flush, so their
+ * clocks start there rather than when they were queued, which would count up
+ * to batch_size - 1 objects of batching delay */
+static void start_import_clocks(struct connection *conn) {
+	uint64_t now = get_time_ns();
+	struct dmabuf_import *import, *tmp;
+	wl_list_for_each_safe(import, tmp, &conn->queued_imports, link) {
+		import->start = now;
+		wl_list_remove(&import->link);
+	}
+}
+
+/* Set once a connection broke on our side, e.g. when libwayland gives up on
+ * a full socket buffer. This says nothing about the compositor's limits, so
+ * the search stops there. */
+static atomic_bool client_failed = false;
+
+static int connection_broke(struct connection *conn) {
+	int err = wl_display_get_error(conn->display);
+	if (err != EPROTO && err != EPIPE && err != ECONNRESET) {
+		fprintf(stderr, "connection broke on the client side: %s\n",
+			strerror(err));
+		atomic_store(&client_failed, true);
+	}
+	return -1;
+}
+
+/* Flushes every FLUSH_BATCH objects, so that large batches don't overflow the
+ * socket buffer, and roundtrips at the end of each batch */
+static int sync_batch(struct connection *conn, uint32_t i) {
+	if ((i + 1) % batch_size != 0 && i + 1 != conn->resource_count) {
+		if ((i + 1) % FLUSH_BATCH != 0) {
+			return 0;
+		}
+		start_import_clocks(conn);
+		if (!display_flush_blocking(conn->display)) {
+			return connection_broke(conn);
+		}
+		return 0;
+	}
+	start_import_clocks(conn);
+	if (timed_roundtrip(conn) == -1) {
+		return connection_broke(conn);
+	}
+	return 0;
+}
+
+static void params_handle_created(void *data,
+		struct zwp_linux_buffer_params_v1 *params, struct wl_buffer *buffer) {
+	struct dmabuf_import *import = data;
+	uint64_t latency = get_time_ns() - import->start;
+	import->conn->buffers[import->index] = buffer;
+
+	pthread_mutex_lock(&import_lock);
+	latency_stats_add(&import_latency, latency);
+	pthread_mutex_unlock(&import_lock);
+
+	zwp_linux_buffer_params_v1_destroy(params);
+	free(import);
+}
+
+static void params_handle_failed(void *data,
+		struct zwp_linux_buffer_params_v1 *params) {
+	struct dmabuf_import *import = data;
+	import->conn->import_failed = true;
+	zwp_linux_buffer_params_v1_destroy(params);
+	free(import);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+	.created = params_handle_created,
+	.failed = params_handle_failed,
+};
+
 struct connection *consume(uint32_t resource_count, enum mode mode, int fd) {
 	const char *resource = "unknown things";
 	if (mode == CONSUME_DMABUF) {
@@ -123,6 +329,16 @@ struct connection *consume(uint32_t resource_count, enum mode mode, int fd) {
 		resource = "wl_region points";
 	} else if (mode == CONSUME_SHMPOOL) {
 		resource = "shm pool mappings";
+	} else if (mode == CONSUME_SURFACE) {
+		resource = "wl_surfaces";
+	} else if (mode == CONSUME_SUBSURFACE) {
+		resource = "wl_subsurfaces";
+	} else if (mode == CONSUME_CALLBACK) {
+		resource = "pending frame callbacks";
+	} else if (mode == CONSUME_POSITIONER) {
+		resource = "xdg_positioners";
+	} else if (mode == CONSUME_BUFFER) {
+		resource = "wl_buffers from one pool";
 	}
 
 	fprintf(stderr, "Trying to create %"PRIu32" %s\n", resource_count, resource);
@@ -132,6 +348,7 @@ struct connection *consume(uint32_t resource_count, enum mode mode, int fd) {
 			return NULL;
 	}
 	conn->resource_count = resource_count;
+	wl_list_init(&conn->queued_imports);
 	conn->display = wl_display_connect(NULL);
 	if (!conn->display) {
 		goto fail;
@@ -155,7 +372,7 @@ struct connection *consume(uint32_t resource_count, enum mode mode, int fd) {
 		for (uint32_t i = 0; i < conn->resource_count; i++) {
 			conn->pools[i] = wl_shm_create_pool(conn->shm, fd, POOL_SIZE);
 			/* the roundtrip checks if this connection broke */
-			if (wl_display_roundtrip(conn->display) == -1) {
+			if (sync_batch(conn, i) == -1) {
 				goto fail;
 			}
 		}
@@ -170,17 +387,27 @@ struct connection *consume(uint32_t resource_count, enum mode mode, int fd) {
 			goto fail;
 		}
 		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			struct dmabuf_import *import =
+				calloc(1, sizeof(struct dmabuf_import));
+			if (!import) {
+				goto fail;
+			}
+			import->conn = conn;
+			import->index = i;
+			wl_list_insert(conn->queued_imports.prev, &import->link);
+
 			struct zwp_linux_buffer_params_v1 *params =
 				zwp_linux_dmabuf_v1_create_params(
 					conn->linux_dmabuf);
+			zwp_linux_buffer_params_v1_add_listener(params,
+				&params_listener, import);
 			zwp_linux_buffer_params_v1_add(params, fd, 0, 0,
 				DMABUF_WIDTH * 4, 0, 0);
-			conn->buffers[i] = zwp_linux_buffer_params_v1_create_immed(
-				params, DMABUF_WIDTH, DMABUF_HEIGHT, DMABUF_FORMAT, 0);
-			zwp_linux_buffer_params_v1_destroy(params);
+			zwp_linux_buffer_params_v1_create(params, DMABUF_WIDTH,
+				DMABUF_HEIGHT, DMABUF_FORMAT, 0);
 
 			/* the roundtrip checks if this connection broke */
-			if (wl_display_roundtrip(conn->display) == -1) {
+			if (sync_batch(conn, i) == -1 || conn->import_failed) {
 				goto fail;
 			}
 		}
@@ -216,15 +443,113 @@ struct connection *consume(uint32_t resource_count, enum mode mode, int fd) {
 			wl_region_add(current_region, x, y, 1, 1);
 
 			if (i % 128 == 0) {
-				if (wl_display_roundtrip(conn->display) == -1) {
+				if (timed_roundtrip(conn) == -1) {
 					goto fail;
 				}
 			}
 		}
 
-		if (wl_display_roundtrip(conn->display) == -1) {
+		if (timed_roundtrip(conn) == -1) {
+			goto fail;
+		}
+		break;
+	case CONSUME_SURFACE:
+		if (!conn->compositor) {
+			fprintf(stderr, "wl_compositor global not available\n");
+			goto fail;
+		}
+		conn->surfaces = calloc(resource_count + 1, sizeof(struct wl_surface *));
+		if (!conn->surfaces) {
+			goto fail;
+		}
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			conn->surfaces[i] = wl_compositor_create_surface(conn->compositor);
+			if (sync_batch(conn, i) == -1) {
+				goto fail;
+			}
+		}
+		break;
+	case CONSUME_SUBSURFACE:
+		if (!conn->compositor || !conn->subcompositor) {
+			fprintf(stderr, "wl_subcompositor global not available\n");
+			goto fail;
+		}
+		conn->surfaces = calloc(resource_count + 1, sizeof(struct wl_surface *));
+		conn->subsurfaces = calloc(resource_count, sizeof(struct wl_subsurface *));
+		if (!conn->surfaces || !conn->subsurfaces) {
+			goto fail;
+		}
+
+		/* surfaces[0] is the root of a tree where each surface has
+		 * a few children, so that it grows both wide and deep */
+		conn->surfaces[0] = wl_compositor_create_surface(conn->compositor);
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			struct wl_surface *parent =
+				conn->surfaces[i / SUBSURFACE_TREE_ARITY];
+			conn->surfaces[i + 1] =
+				wl_compositor_create_surface(conn->compositor);
+			conn->subsurfaces[i] = wl_subcompositor_get_subsurface(
+				conn->subcompositor, conn->surfaces[i + 1], parent);
+			if (sync_batch(conn, i) == -1) {
+				goto fail;
+			}
+		}
+		break;
+	case CONSUME_CALLBACK:
+		if (!conn->compositor) {
+			fprintf(stderr, "wl_compositor global not available\n");
+			goto fail;
+		}
+		conn->callbacks = calloc(resource_count, sizeof(struct wl_callback *));
+		if (!conn->callbacks) {
+			goto fail;
+		}
+
+		/* the surface is never committed, so that every callback
+		 * stays in its pending state */
+		conn->surface = wl_compositor_create_surface(conn->compositor);
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			conn->callbacks[i] = wl_surface_frame(conn->surface);
+			if (sync_batch(conn, i) == -1) {
+				goto fail;
+			}
+		}
+		break;
+	case CONSUME_POSITIONER:
+		if (!conn->wm_base) {
+			fprintf(stderr, "xdg_wm_base global not available\n");
+			goto fail;
+		}
+		conn->positioners = calloc(resource_count, sizeof(struct xdg_positioner *));
+		if (!conn->positioners) {
 			goto fail;
 		}
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			conn->positioners[i] = xdg_wm_base_create_positioner(conn->wm_base);
+			xdg_positioner_set_size(conn->positioners[i], 1, 1);
+			xdg_positioner_set_anchor_rect(conn->positioners[i], 0, 0, 1, 1);
+			if (sync_batch(conn, i) == -1) {
+				goto fail;
+			}
+		}
+		break;
+	case CONSUME_BUFFER:
+		if (!conn->shm) {
+			fprintf(stderr, "wl_shm global not available\n");
+			goto fail;
+		}
+		conn->buffers = calloc(resource_count, sizeof(struct wl_buffer *));
+		if (!conn->buffers) {
+			goto fail;
+		}
+		conn->pool = wl_shm_create_pool(conn->shm, fd, POOL_SIZE);
+		for (uint32_t i = 0; i < conn->resource_count; i++) {
+			conn->buffers[i] = wl_shm_pool_create_buffer(conn->pool, 0,
+				1, 1, 4, WL_SHM_FORMAT_ARGB8888);
+			if (sync_batch(conn, i) == -1) {
+				goto fail;
+			}
+		}
 		break;
 
 	default:
@@ -239,23 +564,446 @@ fail:
 	return NULL;
 }
 
+/* Each round runs the same number of consumers, each with its own connection,
+ * on up to nthreads threads */
+struct round {
+	uint32_t block_size;
+	enum mode mode;
+	int fd;
+	int njobs;
+	int next_job;
+	pthread_mutex_t lock;
+	struct connection **results;
+};
+
+static int nthreads = 1;
+
+/* The compositor is sampled after each round, to print the cost per object
+ * as the object count grows */
+static pid_t compositor_pid = -1;
+static struct process_usage baseline_usage = {0};
+static uint64_t total_objects = 0;
+
+/* The probe is a regular client with a window of its own, running on a
+ * separate thread during consumption. It pings the compositor with
+ * wl_display_sync every PROBE_INTERVAL_MS, and redraws on every frame
+ * callback, to see how responsive the compositor stays. */
+static struct {
+	bool enabled;
+	pthread_t thread;
+	atomic_bool running;
+	struct wl_display *display;
+	struct wleird_toplevel toplevel;
+	uint64_t sync_start, frame_start;
+	bool sync_pending;
+
+	pthread_mutex_t lock;
+	struct latency_stats roundtrip, frame;
+	/* frames committed without a new buffer, since none was free */
+	uint32_t starved;
+} probe = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const struct wl_callback_listener probe_sync_listener;
+static const struct wl_callback_listener probe_frame_listener;
+
+static void probe_sync_done(void *data, struct wl_callback *callback,
+		uint32_t callback_data) {
+	wl_callback_destroy(callback);
+	pthread_mutex_lock(&probe.lock);
+	latency_stats_add(&probe.roundtrip, get_time_ns() - probe.sync_start);
+	pthread_mutex_unlock(&probe.lock);
+	probe.sync_pending = false;
+}
+
+static const struct wl_callback_listener probe_sync_listener = {
+	.done = probe_sync_done,
+};
+
+static void probe_request_frame(void) {
+	struct wl_callback *callback =
+		wl_surface_frame(probe.toplevel.surface.wl_surface);
+	wl_callback_add_listener(callback, &probe_frame_listener, NULL);
+	probe.frame_start = get_time_ns();
+	if (!surface_render(&probe.toplevel.surface)) {
+		/* keep the frame loop going until a buffer is released */
+		wl_surface_commit(probe.toplevel.surface.wl_surface);
+		pthread_mutex_lock(&probe.lock);
+		probe.starved++;
+		pthread_mutex_unlock(&probe.lock);
+	}
+}
+
+static void probe_frame_done(void *data, struct wl_callback *callback,
+		uint32_t time_ms) {
+	wl_callback_destroy(callback);
+	pthread_mutex_lock(&probe.lock);
+	latency_stats_add(&probe.frame, get_time_ns() - probe.frame_start);
+	pthread_mutex_unlock(&probe.lock);
+	probe_request_frame();
+}
+
+static const struct wl_callback_listener probe_frame_listener = {
+	.done = probe_frame_done,
+};
+
+static void *probe_run(void *data) {
+	struct wl_display *display = probe.display;
+	registry_init(display);
+	toplevel_init(&probe.toplevel);
+	float color[4] = {0, 0, 1, 1};
+	memcpy(probe.toplevel.surface.color, color, sizeof(float[4]));
+	// Wait for the first configure, which renders the window
+	wl_display_roundtrip(display);
+	probe_request_frame();
+
+	while (atomic_load(&probe.running)) {
+		uint64_t now = get_time_ns();
+		if (!probe.sync_pending &&
+				now - probe.sync_start >= PROBE_INTERVAL_MS * 1000000) {
+			struct wl_callback *callback = wl_display_sync(display);
+			wl_callback_add_listener(callback, &probe_sync_listener, NULL);
+			probe.sync_start = now;
+			probe.sync_pending = true;
+		}
+
+		while (wl_display_prepare_read(display) != 0) {
+			wl_display_dispatch_pending(display);
+		}
+		if (wl_display_flush(display) == -1 && errno != EAGAIN) {
+			wl_display_cancel_read(display);
+			break;
+		}
+
+		struct pollfd pfd = {
+			.fd = wl_display_get_fd(display),
+			.events = POLLIN,
+		};
+		if (poll(&pfd, 1, PROBE_INTERVAL_MS) > 0) {
+			if (wl_display_read_events(display) == -1) {
+				break;
+			}
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (wl_display_dispatch_pending(display) == -1) {
+			break;
+		}
+	}
+	if (atomic_load(&probe.running)) {
+		fprintf(stderr, "probe connection broke\n");
+	}
+	return NULL;
+}
+
+static bool probe_start(void) {
+	probe.display = wl_display_connect(NULL);
+	if (!probe.display) {
+		fprintf(stderr, "failed to connect probe\n");
+		return false;
+	}
+	atomic_store(&probe.running, true);
+	if (pthread_create(&probe.thread, NULL, probe_run, NULL) != 0) {
+		wl_display_disconnect(probe.display);
+		return false;
+	}
+	probe.enabled = true;
+	return true;
+}
+
+static void probe_stop(void) {
+	if (!probe.enabled) {
+		return;
+	}
+	atomic_store(&probe.running, false);
+	pthread_join(probe.thread, NULL);
+	wl_display_disconnect(probe.display);
+	latency_stats_finish(&probe.roundtrip);
+	latency_stats_finish(&probe.frame);
+	probe.enabled = false;
+}
+
+/* Prints the probe latencies since the last round, and returns their
+ * medians, or NaN if the compositor answered none at all */
+static void probe_sample(double *roundtrip_us, double *frame_us) {
+	*roundtrip_us = *frame_us = 0;
+	if (!probe.enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&probe.lock);
+	latency_stats_print(&probe.roundtrip, "probe roundtrip");
+	latency_stats_print(&probe.frame, "probe frame");
+	if (probe.starved > 0) {
+		fprintf(stderr, "probe frames without a free buffer: %"PRIu32"\n",
+			probe.starved);
+	}
+	*roundtrip_us = probe.roundtrip.len == 0 ? NAN :
+		latency_stats_percentile(&probe.roundtrip, 50) / 1e3;
+	*frame_us = probe.frame.len == 0 ? NAN :
+		latency_stats_percentile(&probe.frame, 50) / 1e3;
+	latency_stats_reset(&probe.roundtrip);
+	latency_stats_reset(&probe.frame);
+	probe.starved = 0;
+	pthread_mutex_unlock(&probe.lock);
+}
+
+static void *round_worker(void *data) {
+	struct round *round = data;
+	while (true) {
+		pthread_mutex_lock(&round->lock);
+		int job = round->next_job++;
+		pthread_mutex_unlock(&round->lock);
+		if (job >= round->njobs) {
+			return NULL;
+		}
+		round->results[job] = consume(round->block_size, round->mode,
+			round->fd);
+	}
+}
+
+static const char *mode_name(enum mode mode) {
+	switch (mode) {
+	case CONSUME_SHMPOOL:
+		return "shmpool";
+	case CONSUME_DMABUF:
+		return "dmabuf";
+	case CONSUME_REGION:
+		return "region";
+	case CONSUME_SURFACE:
+		return "surface";
+	case CONSUME_SUBSURFACE:
+		return "subsurface";
+	case CONSUME_CALLBACK:
+		return "callback";
+	case CONSUME_POSITIONER:
+		return "positioner";
+	case CONSUME_BUFFER:
+		return "buffer";
+	default:
+		return "noop";
+	}
+}
+
+/* Prints a CSV row: the per-object columns are relative to the compositor's
+ * usage before the first round, and to the time taken by this round */
+static void print_usage_sample(enum mode mode, uint64_t objects,
+		double elapsed, double sync_us) {
+	double probe_roundtrip_us, probe_frame_us;
+	probe_sample(&probe_roundtrip_us, &probe_frame_us);
+
+	struct process_usage usage;
+	if (compositor_pid <= 0 || !get_process_usage(compositor_pid, &usage)) {
+		return;
+	}
+
+	double per_object = total_objects ? 1.0 / total_objects : 0;
+	printf("%s,%"PRIu64",%"PRIu64",%"PRIu64",%d,%d,%.1f,%.1f,%.3f,%.1f,"
+		"%.1f,%.1f\n",
+		mode_name(mode), total_objects, usage.rss, usage.pss, usage.fds,
+		usage.maps,
+		((double)usage.rss - (double)baseline_usage.rss) * per_object,
+		((double)usage.pss - (double)baseline_usage.pss) * per_object,
+		objects ? elapsed * 1e6 / objects : 0, sync_us,
+		probe_roundtrip_us, probe_frame_us);
+	fflush(stdout);
+}
+
+/* Runs njobs consumers of block_size objects, adds the connections which
+ * succeeded to the list, and returns how many did */
+static int run_round(struct wl_list *connections, int njobs,
+		uint32_t block_size, enum mode mode, int fd) {
+	struct connection *results[MAX_THREADS] = {0};
+	struct round round = {
+		.block_size = block_size,
+		.mode = mode,
+		.fd = fd,
+		.njobs = njobs,
+		.results = results,
+	};
+	pthread_mutex_init(&round.lock, NULL);
+
+	uint64_t start = get_time_ns();
+	pthread_t threads[MAX_THREADS];
+	int started = 0;
+	for (; started < nthreads && started < njobs; started++) {
+		if (pthread_create(&threads[started], NULL, round_worker,
+				&round) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		// Could not start any thread, run the round here
+		round_worker(&round);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&round.lock);
+
+	int succeeded = 0;
+	uint64_t sync_time = 0, syncs = 0;
+	for (int i = 0; i < njobs; i++) {
+		if (results[i]) {
+			wl_list_insert(connections, &results[i]->link);
+			sync_time += results[i]->sync_time;
+			syncs += results[i]->syncs;
+			succeeded++;
+		}
+	}
+	double sync_us = syncs ? sync_time / 1e3 / syncs : 0;
+
+	double elapsed = (get_time_ns() - start) / 1e9;
+	uint64_t objects = (uint64_t)succeeded * block_size;
+	total_objects += objects;
+	fprintf(stderr, "Created %"PRIu64" objects in %.1fms (%.0f objects/s), "
+		"roundtrips took %.1fus\n", objects, elapsed * 1000,
+		objects / elapsed, sync_us);
+	print_usage_sample(mode, objects, elapsed, sync_us);
+	if (mode == CONSUME_DMABUF) {
+		latency_stats_print(&import_latency, "dmabuf import");
+		latency_stats_reset(&import_latency);
+	}
+	return succeeded;
+}
+
+#ifdef HAVE_GBM
+static int create_gbm_dmabuf(void) {
+	/* todo: select device based on linux-dmabuf primary_device,
+	 * when it becomes widely available */
+	int drm_fd = open("/dev/dri/renderD128", O_RDWR | O_CLOEXEC);
+	if (drm_fd == -1) {
+		fprintf(stderr, "failed to open drm device /dev/dri/renderD128.\n");
+		return -1;
+	}
+	struct gbm_device *gbm = gbm_create_device(drm_fd);
+	if (!gbm) {
+		fprintf(stderr, "failed to create gbm device.\n");
+		close(drm_fd);
+		return -1;
+	}
+	struct gbm_bo *bo = gbm_bo_create(gbm, DMABUF_WIDTH,
+		DMABUF_HEIGHT, DMABUF_FORMAT,
+		GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+	if (!bo) {
+		fprintf(stderr, "failed to create dmabuf.\n");
+		gbm_device_destroy(gbm);
+		close(drm_fd);
+		return -1;
+	}
+	int fd = gbm_bo_get_fd(bo);
+	if (fd == -1) {
+		fprintf(stderr, "failed to export dmabuf to fd.\n");
+	}
+	gbm_bo_destroy(bo);
+	gbm_device_destroy(gbm);
+	close(drm_fd);
+	return fd;
+}
+#else
+static int create_gbm_dmabuf(void) {
+	fprintf(stderr, "built without GBM.\n");
+	return -1;
+}
+#endif
+
+#ifdef HAVE_UDMABUF
+/* Builds a dmabuf out of a memfd, without any GPU. udmabuf requires the memfd
+ * to be sealed against shrinking. */
+static int create_udmabuf(void) {
+	int dev_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (dev_fd == -1) {
+		fprintf(stderr, "failed to open /dev/udmabuf.\n");
+		return -1;
+	}
+	int memfd = create_memfd_pool_file(DMABUF_SIZE, F_SEAL_SHRINK);
+	if (memfd == -1) {
+		fprintf(stderr, "failed to create sealed memfd.\n");
+		close(dev_fd);
+		return -1;
+	}
+
+	struct udmabuf_create create = {
+		.memfd = memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = 0,
+		.size = DMABUF_SIZE,
+	};
+	int fd = ioctl(dev_fd, UDMABUF_CREATE, &create);
+	if (fd == -1) {
+		fprintf(stderr, "failed to create udmabuf.\n");
+	}
+	close(memfd);
+	close(dev_fd);
+	return fd;
+}
+#else
+static int create_udmabuf(void) {
+	fprintf(stderr, "built without udmabuf.\n");
+	return -1;
+}
+#endif
+
 static const char program_desc[] =
 	"This program creates as many objects associated with a given finite resource\n"
 	"as it can, until the compositor cannot accept any more. Since most code is not\n"
 	"tested in resource-constrained scenarios, this can make the compositor crash.\n"
 	"  shmpool: memory map areas;  dmabuf: file descriptors;  region: memory\n"
+	"  surface, subsurface, callback, positioner: protocol objects\n"
+	"  buffer: wl_buffers from a single shm pool\n"
 	"\n"
-	"usage: resource-thief (shmpool|dmabuf|region)\n";
+	"usage: resource-thief [-j threads] [-b batch] [-u] [-p] MODE\n"
+	"  -j: number of connections consuming in parallel (default 1)\n"
+	"  -b: number of objects created between roundtrips (default 1)\n"
+	"  -u: allocate dmabufs with udmabuf rather than GBM (Linux only)\n"
+	"  -p: measure roundtrip and frame latency from a window meanwhile\n"
+	"\n"
+	"After each step, the compositor's RSS, PSS, fd and mapping counts are\n"
+	"printed as CSV on stdout, with the cost per object. The probe columns are\n"
+	"nan when the compositor sent no frame callback or sync reply that step.\n";
 
 int main(int argc, char *argv[]) {
+	bool use_udmabuf = false, use_probe = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:b:up")) != -1) {
+		switch (opt) {
+		case 'p':
+			use_probe = true;
+			break;
+		case 'u':
+			use_udmabuf = true;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'b':
+			batch_size = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, program_desc);
+			return EXIT_FAILURE;
+		}
+	}
+
 	enum mode mode = CONSUME_NOOP;
-	if (argc == 2) {
-		if (!strcmp(argv[1], "shmpool")) {
+	if (optind == argc - 1 && nthreads > 0 && nthreads <= MAX_THREADS &&
+			batch_size > 0) {
+		const char *name = argv[optind];
+		if (!strcmp(name, "shmpool")) {
 			mode = CONSUME_SHMPOOL;
-		} else if (!strcmp(argv[1], "dmabuf")) {
+		} else if (!strcmp(name, "dmabuf")) {
 			mode = CONSUME_DMABUF;
-		} else if (!strcmp(argv[1], "region")) {
+		} else if (!strcmp(name, "region")) {
 			mode = CONSUME_REGION;
+		} else if (!strcmp(name, "surface")) {
+			mode = CONSUME_SURFACE;
+		} else if (!strcmp(name, "subsurface")) {
+			mode = CONSUME_SUBSURFACE;
+		} else if (!strcmp(name, "callback")) {
+			mode = CONSUME_CALLBACK;
+		} else if (!strcmp(name, "positioner")) {
+			mode = CONSUME_POSITIONER;
+		} else if (!strcmp(name, "buffer")) {
+			mode = CONSUME_BUFFER;
 		}
 	}
 
@@ -268,71 +1016,72 @@ int main(int argc, char *argv[]) {
 	wl_list_init(&connections);
 
 	int fd = -1;
-	if (mode == CONSUME_SHMPOOL) {
+	if (mode == CONSUME_SHMPOOL || mode == CONSUME_BUFFER) {
 		fd = create_pool_file(POOL_SIZE);
 		if (fd == -1) {
 			fprintf(stderr, "failed to create pool file.\n");
 			return EXIT_FAILURE;
 		}
 	} else if (mode == CONSUME_DMABUF) {
-		/* todo: select device based on linux-dmabuf primary_device,
-		 * when it becomes widely available */
-		int drm_fd = open("/dev/dri/renderD128", O_RDWR | O_CLOEXEC);
-		if (drm_fd == -1) {
-			fprintf(stderr, "failed to open drm device /dev/dri/renderD128.\n");
-			return EXIT_FAILURE;
+		if (!use_udmabuf) {
+			fd = create_gbm_dmabuf();
 		}
-		struct gbm_device *gbm = gbm_create_device(drm_fd);
-		if (!gbm) {
-			fprintf(stderr, "failed to create gbm device.\n");
-			return EXIT_FAILURE;
-		}
-		struct gbm_bo *bo = gbm_bo_create(gbm, DMABUF_WIDTH,
-			DMABUF_HEIGHT, DMABUF_FORMAT,
-			GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
-		if (!bo) {
-			fprintf(stderr, "failed to create dmabuf.\n");
-			return EXIT_FAILURE;
+		if (fd == -1) {
+			fd = create_udmabuf();
 		}
-		fd = gbm_bo_get_fd(bo);
-		if (!bo) {
-			fprintf(stderr, "failed to export dmabuf to fd.\n");
-			return EXIT_FAILURE;
+		if (fd == -1) {
+			/* not an error: this machine has no way to make dmabufs */
+			fprintf(stderr, "no dmabuf allocator available, skipping.\n");
+			return EXIT_SUCCESS;
 		}
-		gbm_bo_destroy(bo);
-		gbm_device_destroy(gbm);
 	}
 
-	/* Binary search to create as many objects as possible */
-	uint64_t total_pools = 0;
+	/* A connection of our own, to find out which process the compositor is */
+	struct wl_display *monitor = wl_display_connect(NULL);
+	if (monitor) {
+		compositor_pid = get_compositor_pid(monitor);
+	}
+	if (compositor_pid <= 0 ||
+			!get_process_usage(compositor_pid, &baseline_usage)) {
+		fprintf(stderr, "cannot sample compositor usage, no CSV output\n");
+		compositor_pid = -1;
+	} else {
+		printf("mode,objects,rss,pss,fds,maps,rss_per_object,"
+			"pss_per_object,us_per_object,roundtrip_us,"
+			"probe_roundtrip_us,probe_frame_us\n");
+	}
+
+	if (use_probe && !probe_start()) {
+		fprintf(stderr, "failed to start probe\n");
+	}
+
+	/* Binary search to create as many objects as possible, with one
+	 * consumer per thread at each block size */
+	uint64_t start = get_time_ns();
 	uint32_t block_size = 1;
 	while (block_size < (1uLL << 31)) {
-		struct connection *c = consume(block_size, mode, fd);
-		if (!c) {
+		int n = run_round(&connections, nthreads, block_size, mode, fd);
+		if (n < nthreads || atomic_load(&client_failed)) {
 			break;
 		}
-		total_pools += block_size;
-		wl_list_insert(&connections, &c->link);
 
 		block_size = 2 * block_size;
 	}
-	while (block_size) {
-		struct connection *c = consume(block_size, mode, fd);
-		if (c) {
-			total_pools += block_size;
-			wl_list_insert(&connections, &c->link);
-		}
+	while (block_size && !atomic_load(&client_failed)) {
+		run_round(&connections, nthreads, block_size, mode, fd);
 
 		block_size = block_size / 2;
 	}
-	for (int i = 0; i < 10; i++) {
-		struct connection *c = consume(1, mode, fd);
-		if (c) {
-			total_pools++;
-			wl_list_insert(&connections, &c->link);
-		}
+	if (!atomic_load(&client_failed)) {
+		run_round(&connections, 10, 1, mode, fd);
+	} else {
+		fprintf(stderr, "stopped early: the client failed, "
+			"not the compositor\n");
 	}
-	fprintf(stderr, "Total pools: %"PRIu64"\n", total_pools);
+	double elapsed = (get_time_ns() - start) / 1e9;
+	fprintf(stderr, "Total pools: %"PRIu64" in %.1fs (%.0f objects/s)\n",
+		total_objects, elapsed, total_objects / elapsed);
+	probe_stop();
 
 	/* Wait until Ctrl+C, then clean up and exit */
 	fprintf(stderr, "Waiting for SIGINT...\n");
@@ -357,7 +1106,10 @@ int main(int argc, char *argv[]) {
 		destroy_connection(cur);
 	}
 
-	if (mode == CONSUME_SHMPOOL || mode == CONSUME_DMABUF) {
+	if (monitor) {
+		wl_display_disconnect(monitor);
+	}
+	if (fd != -1) {
 		close(fd);
 	}
 	fprintf(stderr, "\nDone.\n");
@@ -1,9 +1,50 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include "client.h"
 #include "pool-buffer.h"
+#include "stats.h"
+
+#define WIDTH 512
+#define HEIGHT 512
+#define TRUNCATE_RATE 10
+#define TRUNCATED_SIZE 42
+
+/* In the unsealed and sealed modes, two buffers from a single memfd pool are
+ * committed on every frame, while a timer truncates the pool file and grows
+ * it back. A sealed pool refuses to shrink, so the compositor could skip its
+ * SIGBUS protection for it. An unsealed pool is expected to get the client
+ * killed with a protocol error as soon as the compositor reads it while it is
+ * truncated, so the time until then is part of the result. */
+struct suite_buffer {
+	struct wl_buffer *buffer;
+	bool busy;
+	uint64_t commit_time;
+};
+
+static struct {
+	bool sealed;
+	int fd;
+	size_t size;
+	bool truncated;
+	struct wl_surface *surface;
+	struct suite_buffer buffers[2];
+
+	pid_t compositor_pid;
+	uint64_t compositor_cpu_time;
+	uint64_t start, last_report;
+	// Counters since the last report
+	int commits, skipped, truncations, refused;
+	struct latency_stats release_latency;
+} suite = {0};
 
 static void xdg_surface_handle_configure(void *data,
 		struct xdg_surface *xdg_surface, uint32_t serial) {
@@ -14,16 +55,22 @@ static const struct xdg_surface_listener sigbus_xdg_surface_listener = {
 	.configure = xdg_surface_handle_configure,
 };
 
-int main(int argc, char *argv[]) {
-	struct wl_display *display = wl_display_connect(NULL);
-	if (display == NULL) {
-		fprintf(stderr, "failed to create display\n");
-		return EXIT_FAILURE;
-	}
+static struct wl_surface *create_toplevel(struct wl_display *display) {
+	struct wl_surface *surface = wl_compositor_create_surface(compositor);
 
-	registry_init(display);
+	struct xdg_surface *xdg_surface =
+		xdg_wm_base_get_xdg_surface(wm_base, surface);
+	xdg_surface_add_listener(xdg_surface, &sigbus_xdg_surface_listener, NULL);
+	xdg_surface_get_toplevel(xdg_surface);
+	wl_surface_commit(surface);
+
+	// Wait for the xdg_surface.configure event
+	wl_display_roundtrip(display);
+	return surface;
+}
 
-	int width = 512, height = 512, stride = width * 4;
+static int run_once(struct wl_display *display) {
+	int width = WIDTH, height = HEIGHT, stride = width * 4;
 	size_t size = stride * height;
 	int fd = create_pool_file(size);
 	if (fd < 0) {
@@ -38,22 +85,13 @@ int main(int argc, char *argv[]) {
 	wl_display_roundtrip(display);
 
 	// Shrink the file
-	size = 42;
+	size = TRUNCATED_SIZE;
 	if (ftruncate(fd, size) < 0) {
 		perror("ftruncate failed");
 		return EXIT_FAILURE;
 	}
 
-	struct wl_surface *surface = wl_compositor_create_surface(compositor);
-
-	struct xdg_surface *xdg_surface =
-		xdg_wm_base_get_xdg_surface(wm_base, surface);
-	xdg_surface_add_listener(xdg_surface, &sigbus_xdg_surface_listener, NULL);
-	xdg_surface_get_toplevel(xdg_surface);
-	wl_surface_commit(surface);
-
-	// Wait for the xdg_surface.configure event
-	wl_display_roundtrip(display);
+	struct wl_surface *surface = create_toplevel(display);
 
 	wl_surface_attach(surface, buffer, 0, 0);
 	wl_surface_damage_buffer(surface, 0, 0, width, height);
@@ -67,3 +105,250 @@ int main(int argc, char *argv[]) {
 
 	return 0;
 }
+
+static void buffer_handle_release(void *data, struct wl_buffer *wl_buffer) {
+	struct suite_buffer *buffer = data;
+	buffer->busy = false;
+	latency_stats_add(&suite.release_latency,
+		get_time_ns() - buffer->commit_time);
+}
+
+static const struct wl_buffer_listener suite_buffer_listener = {
+	.release = buffer_handle_release,
+};
+
+static const struct wl_callback_listener frame_listener;
+
+static void commit_frame(void) {
+	struct suite_buffer *buffer = NULL;
+	for (size_t i = 0; i < 2; i++) {
+		if (!suite.buffers[i].busy) {
+			buffer = &suite.buffers[i];
+			break;
+		}
+	}
+
+	struct wl_callback *callback = wl_surface_frame(suite.surface);
+	wl_callback_add_listener(callback, &frame_listener, NULL);
+	if (buffer == NULL) {
+		// Both buffers still held by the compositor, try next frame
+		suite.skipped++;
+		wl_surface_commit(suite.surface);
+		return;
+	}
+
+	wl_surface_attach(suite.surface, buffer->buffer, 0, 0);
+	wl_surface_damage_buffer(suite.surface, 0, 0, WIDTH, HEIGHT);
+	wl_surface_commit(suite.surface);
+	buffer->busy = true;
+	buffer->commit_time = get_time_ns();
+	suite.commits++;
+}
+
+static void frame_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time_ms) {
+	wl_callback_destroy(callback);
+	commit_frame();
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+/* Alternates between shrinking the pool file and growing it back */
+static void toggle_truncation(void) {
+	size_t size = suite.truncated ? suite.size : TRUNCATED_SIZE;
+	if (ftruncate(suite.fd, size) < 0) {
+		if (errno != EPERM) {
+			perror("ftruncate failed");
+		}
+		suite.refused++;
+		return;
+	}
+	suite.truncated = !suite.truncated;
+	if (suite.truncated) {
+		suite.truncations++;
+	}
+}
+
+/* Prints the counters about once per second, or right away if forced */
+static void report(bool force) {
+	uint64_t now = get_time_ns();
+	if (now - suite.last_report < 1000000000 && !force) {
+		return;
+	}
+	if (now == suite.last_report) {
+		return;
+	}
+
+	double elapsed = (now - suite.last_report) / 1e9;
+	uint64_t cpu_time = get_process_cpu_time(suite.compositor_pid);
+	uint64_t cpu_delta = cpu_time - suite.compositor_cpu_time;
+	fprintf(stderr, "%s: commits=%.1f/s skipped=%d truncations=%d "
+		"refused=%d compositor-cpu=%.1fus/commit\n",
+		suite.sealed ? "sealed" : "unsealed", suite.commits / elapsed,
+		suite.skipped, suite.truncations, suite.refused,
+		suite.commits ? cpu_delta / 1e3 / suite.commits : 0);
+	latency_stats_print(&suite.release_latency, "commit to release");
+
+	suite.last_report = now;
+	suite.compositor_cpu_time = cpu_time;
+	suite.commits = suite.skipped = suite.truncations = suite.refused = 0;
+	latency_stats_reset(&suite.release_latency);
+}
+
+static int run_suite(struct wl_display *display, int rate) {
+	int stride = WIDTH * 4;
+	suite.size = 2 * stride * HEIGHT;
+	suite.fd = create_memfd_pool_file(suite.size,
+		suite.sealed ? F_SEAL_SHRINK : 0);
+	if (suite.fd < 0) {
+		fprintf(stderr, "failed to create memfd\n");
+		return EXIT_FAILURE;
+	}
+
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, suite.fd, suite.size);
+	for (size_t i = 0; i < 2; i++) {
+		suite.buffers[i].buffer = wl_shm_pool_create_buffer(pool,
+			i * stride * HEIGHT, WIDTH, HEIGHT, stride,
+			WL_SHM_FORMAT_ARGB8888);
+		wl_buffer_add_listener(suite.buffers[i].buffer,
+			&suite_buffer_listener, &suite.buffers[i]);
+	}
+	wl_shm_pool_destroy(pool);
+
+	suite.surface = create_toplevel(display);
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		fprintf(stderr, "failed to create timer\n");
+		return EXIT_FAILURE;
+	}
+	// Each tick either shrinks the file or grows it back, so it takes two
+	// ticks per truncation
+	long interval_ns = 1000000000L / (2L * rate);
+	struct itimerspec spec = {
+		.it_interval = { interval_ns / 1000000000L, interval_ns % 1000000000L },
+		.it_value = { interval_ns / 1000000000L, interval_ns % 1000000000L },
+	};
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+
+	suite.compositor_pid = get_compositor_pid(display);
+	suite.compositor_cpu_time = get_process_cpu_time(suite.compositor_pid);
+	suite.start = suite.last_report = get_time_ns();
+
+	commit_frame();
+
+	struct pollfd fds[] = {
+		{ .fd = wl_display_get_fd(display), .events = POLLIN },
+		{ .fd = timer_fd, .events = POLLIN },
+	};
+	while (true) {
+		while (wl_display_prepare_read(display) != 0) {
+			wl_display_dispatch_pending(display);
+		}
+		if (wl_display_flush(display) == -1 && errno != EAGAIN) {
+			wl_display_cancel_read(display);
+			break;
+		}
+
+		if (poll(fds, 2, -1) < 0) {
+			wl_display_cancel_read(display);
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(display) == -1) {
+				break;
+			}
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (wl_display_dispatch_pending(display) == -1) {
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+				toggle_truncation();
+			}
+		}
+
+		report(false);
+	}
+
+	// Whatever was gathered since the last report is still worth printing
+	report(true);
+	latency_stats_finish(&suite.release_latency);
+	close(timer_fd);
+	close(suite.fd);
+
+	double alive = (get_time_ns() - suite.start) / 1e9;
+	const struct wl_interface *interface = NULL;
+	uint32_t code = 0;
+	if (wl_display_get_error(display) == EPROTO) {
+		code = wl_display_get_protocol_error(display, &interface, NULL);
+	}
+	if (interface == NULL) {
+		fprintf(stderr, "connection closed after %.3fs\n", alive);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "disconnected after %.3fs by %s error %"PRIu32"\n",
+		alive, interface->name, code);
+	// For an unsealed pool, being killed is the expected outcome
+	return suite.sealed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [once|unsealed|sealed] [rate]\n", bin);
+	fprintf(stderr, "once: shrink the shm file once, then commit (default)\n");
+	fprintf(stderr, "unsealed: keep committing from a memfd pool, while "
+		"truncating it rate times per second (default %d)\n", TRUNCATE_RATE);
+	fprintf(stderr, "sealed: same, with a pool sealed against shrinking\n");
+	fprintf(stderr, "In unsealed mode, the compositor is expected to kill the "
+		"client with a wl_shm error;\nthe time until then and the stats "
+		"gathered so far are the result\n");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 3) {
+		return usage(argv[0]);
+	}
+
+	bool once = true;
+	if (argc > 1) {
+		if (strcmp(argv[1], "sealed") == 0) {
+			once = false;
+			suite.sealed = true;
+		} else if (strcmp(argv[1], "unsealed") == 0) {
+			once = false;
+		} else if (strcmp(argv[1], "once") != 0) {
+			return usage(argv[0]);
+		}
+	}
+	int rate = TRUNCATE_RATE;
+	if (argc > 2) {
+		rate = atoi(argv[2]);
+		if (rate <= 0 || rate > 500000000) {
+			return usage(argv[0]);
+		}
+	}
+
+	struct wl_display *display = wl_display_connect(NULL);
+	if (display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		return EXIT_FAILURE;
+	}
+
+	registry_init(display);
+
+	if (once) {
+		return run_once(display);
+	}
+	return run_suite(display, rate);
+}
@@ -3,23 +3,131 @@
 #include <stdlib.h>
 #include <string.h>
 #include "client.h"
+#include "stats.h"
 
 #define FRAME_DELAY 32
 
+/* How pending configures are acked:
+ * - fixed: every configure, in order, each FRAME_DELAY frames after the
+ *   previous one
+ * - random: same, with a random delay between 1 and twice FRAME_DELAY
+ * - bursty: all pending configures at once, every FRAME_DELAY frames
+ * - latest: only the latest configure, FRAME_DELAY frames after the previous
+ *   ack, never acking intermediate ones */
+enum delay_mode {
+	DELAY_FIXED,
+	DELAY_RANDOM,
+	DELAY_BURSTY,
+	DELAY_LATEST,
+	DELAY_UNKNOWN
+};
+
+static const struct {
+	enum delay_mode mode;
+	const char *desc;
+} options[] = {
+	{DELAY_FIXED, "fixed"},
+	{DELAY_RANDOM, "random"},
+	{DELAY_BURSTY, "bursty"},
+	{DELAY_LATEST, "latest"},
+	{DELAY_UNKNOWN, NULL},
+};
+
 struct configure {
 	uint32_t serial;
 	uint32_t width, height;
+	uint64_t receive_time;
 };
 
+static enum delay_mode mode = DELAY_LATEST;
+static uint32_t frame_delay = FRAME_DELAY;
+
 static bool acked_first_configure = false;
-static struct configure current_configure = { 0 }, next_configure = { 0 };
+static struct configure next_configure = { 0 };
+static struct wl_array pending_configures = {0}; // struct configure
 static uint32_t countdown = 0;
+static bool frame_pending = false;
 static struct wleird_toplevel toplevel = {0};
 static const struct wl_callback_listener callback_listener;
+
+static struct {
+	uint64_t last_report;
+	uint64_t burst_start;
+	int configures, acks;
+	int burst_configures, burst_acks;
+	size_t max_pending;
+	struct latency_stats ack_latency;
+} stats = {0};
+
+static size_t pending_len(void) {
+	return pending_configures.size / sizeof(struct configure);
+}
+
+static uint32_t next_delay(void) {
+	if (mode == DELAY_RANDOM) {
+		return 1 + (uint32_t)rand() % (2 * frame_delay);
+	}
+	return frame_delay;
+}
+
 static void request_frame_callback(void) {
 	struct wl_callback *callback = wl_surface_frame(toplevel.surface.wl_surface);
 	wl_callback_add_listener(callback, &callback_listener, NULL);
 	wl_surface_commit(toplevel.surface.wl_surface);
+	frame_pending = true;
+}
+
+static void report(void) {
+	uint64_t now = get_time_ns();
+	if (now - stats.last_report < 1000000000) {
+		return;
+	}
+
+	double elapsed = (now - stats.last_report) / 1e9;
+	fprintf(stderr, "configures=%.1f/s acks=%.1f/s pending=%zu "
+		"max-pending=%zu pending-memory=%zuB\n", stats.configures / elapsed,
+		stats.acks / elapsed, pending_len(), stats.max_pending,
+		pending_configures.alloc);
+	latency_stats_print(&stats.ack_latency, "configure to ack");
+
+	stats.last_report = now;
+	stats.configures = stats.acks = 0;
+	latency_stats_reset(&stats.ack_latency);
+}
+
+static void ack_configure(struct configure *configure) {
+	fprintf(stderr, "acking configure %d, width: %d, height: %d\n",
+		configure->serial, configure->width, configure->height);
+	xdg_surface_ack_configure(toplevel.xdg_surface, configure->serial);
+	latency_stats_add(&stats.ack_latency,
+		get_time_ns() - configure->receive_time);
+	stats.acks++;
+	stats.burst_acks++;
+
+	toplevel.surface.width = configure->width;
+	toplevel.surface.height = configure->height;
+}
+
+/* Acks the first n pending configures, and removes them from the backlog.
+ * In latest mode, only the last of these is acked. */
+static void ack_pending(size_t n) {
+	struct configure *configures = pending_configures.data;
+	for (size_t i = 0; i < n; i++) {
+		if (mode != DELAY_LATEST || i == n - 1) {
+			ack_configure(&configures[i]);
+		}
+	}
+	surface_render(&toplevel.surface);
+
+	size_t len = pending_len();
+	memmove(configures, &configures[n], (len - n) * sizeof(struct configure));
+	pending_configures.size -= n * sizeof(struct configure);
+
+	if (pending_len() == 0) {
+		fprintf(stderr, "settled after %.1fms: %d configures, %d acks\n",
+			(get_time_ns() - stats.burst_start) / 1e6,
+			stats.burst_configures, stats.burst_acks);
+	}
 }
 
 static void callback_handle_done(void *data, struct wl_callback *callback,
@@ -27,6 +135,9 @@ static void callback_handle_done(void *data, struct wl_callback *callback,
 	if (callback != NULL) {
 		wl_callback_destroy(callback);
 	}
+	frame_pending = false;
+
+	report();
 
 	countdown--;
 	if (countdown > 0) {
@@ -34,19 +145,24 @@ static void callback_handle_done(void *data, struct wl_callback *callback,
 		return;
 	}
 
-	fprintf(stderr, "acking configure %d, width: %d, height: %d\n",
-		current_configure.serial, current_configure.width, current_configure.height);
-	toplevel.surface.width = current_configure.width;
-	toplevel.surface.height = current_configure.height;
-	xdg_surface_ack_configure(toplevel.xdg_surface, current_configure.serial);
-	surface_render(&toplevel.surface);
+	switch (mode) {
+	case DELAY_FIXED:
+	case DELAY_RANDOM:
+		ack_pending(1);
+		break;
+	case DELAY_BURSTY:
+	case DELAY_LATEST:
+		ack_pending(pending_len());
+		break;
+	case DELAY_UNKNOWN:
+		abort();
+	}
 
-	if (next_configure.serial == current_configure.serial) {
+	if (pending_len() == 0) {
 		return;
 	}
 
-	countdown = FRAME_DELAY;
-	current_configure = next_configure;
+	countdown = next_delay();
 	request_frame_callback();
 }
 
@@ -66,10 +182,28 @@ static void xdg_surface_handle_configure(void *data,
 	}
 
 	next_configure.serial = serial;
+	next_configure.receive_time = get_time_ns();
 
-	if (countdown == 0) {
-		current_configure = next_configure;
-		countdown = FRAME_DELAY;
+	if (pending_len() == 0) {
+		stats.burst_start = next_configure.receive_time;
+		stats.burst_configures = stats.burst_acks = 0;
+	}
+
+	struct configure *configure =
+		wl_array_add(&pending_configures, sizeof(struct configure));
+	if (configure == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return;
+	}
+	*configure = next_configure;
+	stats.configures++;
+	stats.burst_configures++;
+	if (pending_len() > stats.max_pending) {
+		stats.max_pending = pending_len();
+	}
+
+	if (!frame_pending) {
+		countdown = next_delay();
 		request_frame_callback();
 	}
 }
@@ -85,7 +219,39 @@ static void xdg_toplevel_handle_configure(void *data,
 	next_configure.height = h;
 }
 
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [delay_mode] [frame_delay]\n", bin);
+	fprintf(stderr, "delay modes:");
+	for (int i = 0; options[i].desc; i++) {
+		fprintf(stderr, " %s", options[i].desc);
+	}
+	fprintf(stderr, "\ndefaults are latest and %d frames\n", FRAME_DELAY);
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
+	if (argc > 3) {
+		return usage(argv[0]);
+	}
+	if (argc > 1) {
+		mode = DELAY_UNKNOWN;
+		for (int i = 0; options[i].desc; i++) {
+			if (!strcmp(options[i].desc, argv[1])) {
+				mode = options[i].mode;
+				break;
+			}
+		}
+		if (mode == DELAY_UNKNOWN) {
+			return usage(argv[0]);
+		}
+	}
+	if (argc > 2) {
+		frame_delay = strtoul(argv[2], NULL, 10);
+		if (frame_delay == 0) {
+			return usage(argv[0]);
+		}
+	}
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
@@ -95,6 +261,9 @@ int main(int argc, char *argv[]) {
 	xdg_surface_listener.configure = xdg_surface_handle_configure;
 	xdg_toplevel_listener.configure = xdg_toplevel_handle_configure;
 
+	wl_array_init(&pending_configures);
+	stats.last_report = get_time_ns();
+
 	registry_init(display);
 	toplevel_init(&toplevel);
 
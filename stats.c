@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/ucred.h>
+#include <sys/un.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "stats.h"
+
+uint64_t get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t timespec_to_ns(uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+		uint32_t tv_nsec) {
+	uint64_t tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+	return tv_sec * 1000000000 + tv_nsec;
+}
+
+void latency_stats_add(struct latency_stats *stats, uint64_t ns) {
+	if (stats->len == stats->cap) {
+		size_t cap = stats->cap ? 2 * stats->cap : 256;
+		uint64_t *samples = realloc(stats->samples, cap * sizeof(uint64_t));
+		if (samples == NULL) {
+			fprintf(stderr, "allocation failed\n");
+			return;
+		}
+		stats->samples = samples;
+		stats->cap = cap;
+	}
+	stats->samples[stats->len++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void latency_stats_print(struct latency_stats *stats, const char *name) {
+	if (stats->len == 0) {
+		fprintf(stderr, "%s: no samples\n", name);
+		return;
+	}
+
+	// Sorting in place is fine, samples are unordered anyways
+	qsort(stats->samples, stats->len, sizeof(uint64_t), compare_u64);
+
+	uint64_t sum = 0;
+	for (size_t i = 0; i < stats->len; i++) {
+		sum += stats->samples[i];
+	}
+
+	size_t n = stats->len;
+	fprintf(stderr, "%s: n=%zu min=%.1fus avg=%.1fus p50=%.1fus "
+		"p99=%.1fus max=%.1fus\n", name, n,
+		stats->samples[0] / 1000.0, sum / n / 1000.0,
+		stats->samples[n / 2] / 1000.0, stats->samples[n * 99 / 100] / 1000.0,
+		stats->samples[n - 1] / 1000.0);
+}
+
+uint64_t latency_stats_percentile(struct latency_stats *stats, double pct) {
+	if (stats->len == 0) {
+		return 0;
+	}
+	qsort(stats->samples, stats->len, sizeof(uint64_t), compare_u64);
+	size_t i = (size_t)(stats->len * pct / 100);
+	if (i >= stats->len) {
+		i = stats->len - 1;
+	}
+	return stats->samples[i];
+}
+
+#define HISTOGRAM_BUCKETS 8
+#define HISTOGRAM_WIDTH 50
+
+void latency_stats_print_histogram(struct latency_stats *stats,
+		const char *name) {
+	latency_stats_print(stats, name);
+	if (stats->len == 0) {
+		return;
+	}
+
+	// Buckets are powers of two milliseconds: <1ms, 1-2ms, 2-4ms, etc
+	size_t buckets[HISTOGRAM_BUCKETS] = {0};
+	size_t max_bucket = 0;
+	for (size_t i = 0; i < stats->len; i++) {
+		uint64_t ms = stats->samples[i] / 1000000;
+		size_t b = 0;
+		while (ms > 0 && b < HISTOGRAM_BUCKETS - 1) {
+			ms >>= 1;
+			b++;
+		}
+		buckets[b]++;
+		if (buckets[b] > max_bucket) {
+			max_bucket = buckets[b];
+		}
+	}
+
+	for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		char range[32];
+		if (b == 0) {
+			snprintf(range, sizeof(range), "<1ms");
+		} else if (b == HISTOGRAM_BUCKETS - 1) {
+			snprintf(range, sizeof(range), ">=%dms", 1 << (b - 1));
+		} else {
+			snprintf(range, sizeof(range), "%d-%dms", 1 << (b - 1), 1 << b);
+		}
+
+		int width = (int)(buckets[b] * HISTOGRAM_WIDTH / max_bucket);
+		fprintf(stderr, "%10s %6zu ", range, buckets[b]);
+		for (int i = 0; i < width; i++) {
+			fputc('#', stderr);
+		}
+		fputc('\n', stderr);
+	}
+}
+
+void latency_stats_reset(struct latency_stats *stats) {
+	stats->len = 0;
+}
+
+void latency_stats_finish(struct latency_stats *stats) {
+	free(stats->samples);
+	memset(stats, 0, sizeof(struct latency_stats));
+}
+
+pid_t get_compositor_pid(struct wl_display *display) {
+#if defined(__linux__)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(wl_display_get_fd(display), SOL_SOCKET, SO_PEERCRED,
+			&cred, &len) == -1) {
+		return -1;
+	}
+	return cred.pid;
+#elif defined(__FreeBSD__) && __FreeBSD_version >= 1300000
+	// cr_pid was added to struct xucred in FreeBSD 13
+	struct xucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(wl_display_get_fd(display), SOL_LOCAL, LOCAL_PEERCRED,
+			&cred, &len) == -1) {
+		return -1;
+	}
+	return cred.cr_pid;
+#else
+	return -1;
+#endif
+}
+
+uint64_t get_process_cpu_time(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	char buf[1024];
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	// The command name may contain spaces and parentheses, skip past it
+	char *p = strrchr(buf, ')');
+	if (p == NULL) {
+		return 0;
+	}
+
+	// utime and stime are the 14th and 15th fields, the state (3rd field)
+	// follows the command name
+	unsigned long long utime = 0, stime = 0;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			&utime, &stime) != 2) {
+		return 0;
+	}
+
+	long ticks = sysconf(_SC_CLK_TCK);
+	return (utime + stime) * (1000000000 / (uint64_t)ticks);
+}
+
+uint64_t get_process_rss(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	char line[256];
+	unsigned long long rss_kib = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %llu kB", &rss_kib) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return rss_kib * 1024;
+}
+
+int get_process_fd_count(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	int count = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] != '.') {
+			count++;
+		}
+	}
+	closedir(dir);
+	return count;
+}
+
+static uint64_t get_process_pss(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	char line[256];
+	unsigned long long pss_kib = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Pss: %llu kB", &pss_kib) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return pss_kib * 1024;
+}
+
+static int get_process_map_count(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	int count = 0, c;
+	while ((c = fgetc(f)) != EOF) {
+		if (c == '\n') {
+			count++;
+		}
+	}
+	fclose(f);
+	return count;
+}
+
+bool get_process_usage(pid_t pid, struct process_usage *usage) {
+	usage->rss = get_process_rss(pid);
+	usage->pss = get_process_pss(pid);
+	usage->fds = get_process_fd_count(pid);
+	usage->maps = get_process_map_count(pid);
+	return usage->rss != 0 && usage->fds >= 0;
+}
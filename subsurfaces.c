@@ -2,12 +2,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <unistd.h>
 #include "client.h"
+#include "stats.h"
+
+#define FANOUT_START 16
+#define FANOUT_DEFAULT_MAX 4096
+#define FANOUT_STEP_DURATION 5000000000 // ns
+#define FANOUT_SIZE 8
+#define FANOUT_COLUMNS 64
+#define FANOUT_FLUSH_BATCH 256
+
+#define RESTACK_DEFAULT_COUNT 1000
+#define RESTACK_BATCH 32
+#define RESTACK_SIZE 16
 
 struct wleird_subsurface {
 	struct wleird_surface surface;
 
 	struct wl_subsurface *wl_subsurface;
+	uint64_t commit_time;
 };
 
 
@@ -144,7 +160,434 @@ static const struct wl_registry_listener registry_listener = {
 };
 
 
+/* In fanout mode, many subsurfaces run their own frame callback loop. Their
+ * number doubles at each step, to find out where the compositor stops keeping
+ * up with the refresh rate. */
+static struct {
+	bool sync, single_pixel;
+	struct wl_display *display;
+	struct wleird_subsurface *subsurfaces;
+	size_t len, max;
+	// Renders which failed on the client side since the last report
+	int failed;
+
+	pid_t compositor_pid;
+	uint64_t compositor_cpu_time;
+	uint64_t step_start;
+	int commits;
+	struct latency_stats latency;
+} fanout = {0};
+
+static const struct wl_callback_listener fanout_callback_listener;
+static const struct wl_callback_listener fanout_parent_callback_listener;
+
+static void fanout_commit(struct wleird_subsurface *subsurface) {
+	struct wleird_surface *surface = &subsurface->surface;
+
+	struct wl_callback *callback = wl_surface_frame(surface->wl_surface);
+	wl_callback_add_listener(callback, &fanout_callback_listener, subsurface);
+
+	if (surface->buffers[0].busy && surface->buffers[1].busy) {
+		// Keep the loop going even if the compositor holds both buffers
+		wl_surface_commit(surface->wl_surface);
+	} else {
+		surface->color[1] = 1 - surface->color[1];
+		if (!surface_render(surface)) {
+			// Still commit, so that the frame callback fires
+			wl_surface_commit(surface->wl_surface);
+			fanout.failed++;
+		}
+	}
+
+	subsurface->commit_time = get_time_ns();
+	fanout.commits++;
+}
+
+static void fanout_add_subsurfaces(size_t len) {
+	for (size_t i = fanout.len; i < len; i++) {
+		struct wleird_subsurface *subsurface = &fanout.subsurfaces[i];
+		subsurface_init(subsurface, toplevel.surface.wl_surface);
+		if (!fanout.sync) {
+			wl_subsurface_set_desync(subsurface->wl_subsurface);
+		}
+		wl_subsurface_set_position(subsurface->wl_subsurface,
+			(i % FANOUT_COLUMNS) * FANOUT_SIZE,
+			(i / FANOUT_COLUMNS) * FANOUT_SIZE);
+
+		subsurface->surface.width = FANOUT_SIZE;
+		subsurface->surface.height = FANOUT_SIZE;
+		subsurface->surface.single_pixel = fanout.single_pixel;
+		float color[4] = {i % 2, 0, 1, 1};
+		memcpy(subsurface->surface.color, color, sizeof(float[4]));
+
+		fanout_commit(subsurface);
+
+		// Don't let a large step overflow the connection's buffer
+		if ((i + 1) % FANOUT_FLUSH_BATCH == 0 &&
+				!display_flush_blocking(fanout.display)) {
+			fprintf(stderr, "failed to flush subsurfaces\n");
+			len = i + 1;
+			break;
+		}
+	}
+	fanout.len = len;
+
+	// Applies the new subsurface positions
+	wl_surface_commit(toplevel.surface.wl_surface);
+}
+
+static void fanout_report(uint64_t now) {
+	uint64_t cpu_time = get_process_cpu_time(fanout.compositor_pid);
+	double elapsed = (now - fanout.step_start) / 1e9;
+	double cpu_us = (cpu_time - fanout.compositor_cpu_time) / 1e3;
+
+	struct process_usage usage = {0};
+	get_process_usage(fanout.compositor_pid, &usage);
+
+	fprintf(stderr, "subsurfaces=%zu buffers=%s opaque=%s commits=%.0f/s "
+		"frames=%.1f/s compositor-cpu=%.1fms/s per-commit=%.1fus "
+		"client-rss=%.1fMiB compositor-pss=%.1fMiB\n", fanout.len,
+		fanout.single_pixel ? "single-pixel" : "shm",
+		opaque_regions ? "yes" : "no",
+		fanout.commits / elapsed, fanout.latency.len / elapsed / fanout.len,
+		cpu_us / 1000 / elapsed,
+		fanout.commits > 0 ? cpu_us / fanout.commits : 0.0,
+		get_process_rss(getpid()) / 1048576.0, usage.pss / 1048576.0);
+	latency_stats_print(&fanout.latency, "commit to frame callback");
+	if (fanout.failed > 0) {
+		// The client ran out of something, not the compositor
+		fprintf(stderr, "%d renders failed in the client, this step isn't "
+			"comparable, stopping here\n", fanout.failed);
+		fanout.max = fanout.len;
+	}
+
+	fanout.compositor_cpu_time = cpu_time;
+	fanout.step_start = now;
+	fanout.commits = fanout.failed = 0;
+	latency_stats_reset(&fanout.latency);
+}
+
+static void fanout_callback_handle_done(void *data,
+		struct wl_callback *callback, uint32_t time_ms) {
+	struct wleird_subsurface *subsurface = data;
+	wl_callback_destroy(callback);
+
+	uint64_t now = get_time_ns();
+	latency_stats_add(&fanout.latency, now - subsurface->commit_time);
+
+	fanout_commit(subsurface);
+
+	if (now - fanout.step_start >= FANOUT_STEP_DURATION) {
+		fanout_report(now);
+		if (fanout.len < fanout.max) {
+			size_t len = 2 * fanout.len;
+			fanout_add_subsurfaces(len < fanout.max ? len : fanout.max);
+		}
+	}
+}
+
+static const struct wl_callback_listener fanout_callback_listener = {
+	.done = fanout_callback_handle_done,
+};
+
+static void fanout_request_parent_frame(void) {
+	struct wl_callback *callback =
+		wl_surface_frame(toplevel.surface.wl_surface);
+	wl_callback_add_listener(callback, &fanout_parent_callback_listener, NULL);
+	wl_surface_commit(toplevel.surface.wl_surface);
+	fanout.commits++;
+}
+
+static void fanout_parent_callback_handle_done(void *data,
+		struct wl_callback *callback, uint32_t time_ms) {
+	wl_callback_destroy(callback);
+
+	// In sync mode, the cached state of the subsurfaces is only applied
+	// when the parent commits
+	fanout_request_parent_frame();
+}
+
+static const struct wl_callback_listener fanout_parent_callback_listener = {
+	.done = fanout_parent_callback_handle_done,
+};
+
+static int run_fanout(struct wl_display *display) {
+	if (fanout.single_pixel && (single_pixel_buffer_manager == NULL ||
+			viewporter == NULL)) {
+		fprintf(stderr, "compositor doesn't support "
+			"wp_single_pixel_buffer_manager_v1 or wp_viewporter\n");
+		return EXIT_FAILURE;
+	}
+
+	fanout.subsurfaces = calloc(fanout.max, sizeof(struct wleird_subsurface));
+	if (fanout.subsurfaces == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return EXIT_FAILURE;
+	}
+
+	// In shm mode, every subsurface keeps two pool files open
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+	fanout.display = display;
+
+	// Wait for the toplevel to be mapped
+	wl_display_roundtrip(display);
+
+	fanout.compositor_pid = get_compositor_pid(display);
+	fanout.compositor_cpu_time = get_process_cpu_time(fanout.compositor_pid);
+	fanout.step_start = get_time_ns();
+
+	size_t len = FANOUT_START < fanout.max ? FANOUT_START : fanout.max;
+	fanout_add_subsurfaces(len);
+	if (fanout.sync) {
+		fanout_request_parent_frame();
+	}
+
+	while (wl_display_dispatch(display) != -1) {
+		// This space intentionally left blank
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* In restack mode, a deep chain or a wide fan of subsurfaces is shuffled
+ * around with random batches of restack and set_position requests, as fast
+ * as the compositor goes. In a deep chain of synchronized subsurfaces, each
+ * batch needs to commit every ancestor of the touched subsurfaces. */
+static struct {
+	bool deep, sync;
+	struct wleird_subsurface *subsurfaces;
+	size_t len;
+
+	uint64_t attach_time[2];
+	uint64_t report_start;
+	int batches, commits;
+	struct latency_stats latency;
+} restack = {0};
+
+static const struct wl_callback_listener restack_callback_listener;
+
+static struct wl_surface *restack_get_parent(size_t i) {
+	if (restack.deep && i > 0) {
+		return restack.subsurfaces[i - 1].surface.wl_surface;
+	}
+	return toplevel.surface.wl_surface;
+}
+
+static void restack_buffer_handle_release(struct pool_buffer *buffer,
+		void *data) {
+	for (size_t i = 0; i < 2; i++) {
+		if (buffer == &toplevel.surface.buffers[i] &&
+				restack.attach_time[i] != 0) {
+			latency_stats_add(&restack.latency,
+				get_time_ns() - restack.attach_time[i]);
+			restack.attach_time[i] = 0;
+		}
+	}
+}
+
+static void restack_batch(struct wl_display *display) {
+	// Index of the deepest parent which needs to be committed, the
+	// toplevel being -1
+	ssize_t deepest_parent = -1;
+	for (int i = 0; i < RESTACK_BATCH; i++) {
+		size_t j = (size_t)rand() % restack.len;
+		struct wleird_subsurface *subsurface = &restack.subsurfaces[j];
+
+		// In a deep chain, the parent is the only sibling
+		struct wl_surface *sibling = restack_get_parent(j);
+		if (!restack.deep) {
+			size_t k = (size_t)rand() % restack.len;
+			if (k != j) {
+				sibling = restack.subsurfaces[k].surface.wl_surface;
+			}
+		}
+
+		switch (rand() % 3) {
+		case 0:
+			wl_subsurface_place_above(subsurface->wl_subsurface, sibling);
+			break;
+		case 1:
+			wl_subsurface_place_below(subsurface->wl_subsurface, sibling);
+			break;
+		case 2:
+			wl_subsurface_set_position(subsurface->wl_subsurface,
+				rand() % RESTACK_SIZE, rand() % RESTACK_SIZE);
+			break;
+		}
+
+		if (restack.deep && (ssize_t)j - 1 > deepest_parent) {
+			deepest_parent = (ssize_t)j - 1;
+		}
+	}
+
+	for (ssize_t i = deepest_parent; i >= 0; i--) {
+		wl_surface_commit(restack.subsurfaces[i].surface.wl_surface);
+		restack.commits++;
+	}
+
+	struct wleird_surface *surface = &toplevel.surface;
+	if (surface->buffers[0].busy && surface->buffers[1].busy) {
+		wl_surface_commit(surface->wl_surface);
+	} else {
+		surface->color[2] = 1 - surface->color[2];
+		surface_render(surface);
+		for (size_t i = 0; i < 2; i++) {
+			if (surface->buffers[i].busy && restack.attach_time[i] == 0) {
+				restack.attach_time[i] = get_time_ns();
+			}
+		}
+	}
+	restack.commits++;
+	restack.batches++;
+
+	struct wl_callback *callback = wl_display_sync(display);
+	wl_callback_add_listener(callback, &restack_callback_listener, display);
+}
+
+static void restack_callback_handle_done(void *data,
+		struct wl_callback *callback, uint32_t serial) {
+	struct wl_display *display = data;
+	wl_callback_destroy(callback);
+
+	uint64_t now = get_time_ns();
+	if (now - restack.report_start >= 1000000000) {
+		double elapsed = (now - restack.report_start) / 1e9;
+		fprintf(stderr, "batches=%.0f/s commits=%.0f/s\n",
+			restack.batches / elapsed, restack.commits / elapsed);
+		latency_stats_print(&restack.latency, "commit to release");
+
+		restack.report_start = now;
+		restack.batches = restack.commits = 0;
+		latency_stats_reset(&restack.latency);
+	}
+
+	restack_batch(display);
+}
+
+static const struct wl_callback_listener restack_callback_listener = {
+	.done = restack_callback_handle_done,
+};
+
+static int run_restack(struct wl_display *display) {
+	restack.subsurfaces = calloc(restack.len,
+		sizeof(struct wleird_subsurface));
+	if (restack.subsurfaces == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < 2; i++) {
+		toplevel.surface.buffers[i].release = restack_buffer_handle_release;
+	}
+
+	// Wait for the toplevel to be mapped
+	wl_display_roundtrip(display);
+
+	for (size_t i = 0; i < restack.len; i++) {
+		struct wleird_subsurface *subsurface = &restack.subsurfaces[i];
+		subsurface_init(subsurface, restack_get_parent(i));
+		if (!restack.sync) {
+			wl_subsurface_set_desync(subsurface->wl_subsurface);
+		}
+
+		int x = 1, y = 1;
+		if (!restack.deep) {
+			x = (i % FANOUT_COLUMNS) * RESTACK_SIZE;
+			y = (i / FANOUT_COLUMNS) * RESTACK_SIZE;
+		}
+		wl_subsurface_set_position(subsurface->wl_subsurface, x, y);
+
+		subsurface->surface.width = RESTACK_SIZE;
+		subsurface->surface.height = RESTACK_SIZE;
+		float color[4] = {(float)i / restack.len, 0, 1, 1};
+		memcpy(subsurface->surface.color, color, sizeof(float[4]));
+	}
+
+	// Commit children before their parents, so that the whole tree gets
+	// mapped in one go
+	for (size_t i = restack.len; i > 0; i--) {
+		surface_render(&restack.subsurfaces[i - 1].surface);
+	}
+	wl_surface_commit(toplevel.surface.wl_surface);
+	wl_display_roundtrip(display);
+
+	fprintf(stderr, "restacking a %s tree of %zu %s subsurfaces\n",
+		restack.deep ? "deep" : "wide", restack.len,
+		restack.sync ? "sync" : "desync");
+	restack.report_start = get_time_ns();
+	restack_batch(display);
+
+	while (wl_display_dispatch(display) != -1) {
+		// This space intentionally left blank
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int usage(char *bin) {
+	fprintf(stderr, "Usage: %s [fanout [max] [sync|desync] "
+		"[shm|single-pixel]]\n", bin);
+	fprintf(stderr, "       %s [restack deep|wide [count] [sync|desync]]\n",
+		bin);
+	fprintf(stderr, "fanout: animate a growing number of subsurfaces, "
+		"up to max (default %d), filled with shm (default) or single-pixel "
+		"buffers\n", FANOUT_DEFAULT_MAX);
+	fprintf(stderr, "restack: shuffle a tree of count (default %d) "
+		"subsurfaces around\n", RESTACK_DEFAULT_COUNT);
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[]) {
+	bool fanout_mode = false, restack_mode = false;
+	if (argc > 1 && strcmp(argv[1], "fanout") == 0 && argc <= 5) {
+		fanout_mode = true;
+		fanout.max = FANOUT_DEFAULT_MAX;
+		fanout.sync = false;
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "sync") == 0) {
+				fanout.sync = true;
+			} else if (strcmp(argv[i], "desync") == 0) {
+				fanout.sync = false;
+			} else if (strcmp(argv[i], "single-pixel") == 0) {
+				fanout.single_pixel = true;
+			} else if (strcmp(argv[i], "shm") == 0) {
+				fanout.single_pixel = false;
+			} else {
+				fanout.max = strtoul(argv[i], NULL, 10);
+				if (fanout.max == 0) {
+					return usage(argv[0]);
+				}
+			}
+		}
+	} else if (argc > 2 && strcmp(argv[1], "restack") == 0 && argc <= 5) {
+		restack_mode = true;
+		if (strcmp(argv[2], "deep") == 0) {
+			restack.deep = true;
+		} else if (strcmp(argv[2], "wide") != 0) {
+			return usage(argv[0]);
+		}
+		restack.len = RESTACK_DEFAULT_COUNT;
+		restack.sync = true;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "sync") == 0) {
+				restack.sync = true;
+			} else if (strcmp(argv[i], "desync") == 0) {
+				restack.sync = false;
+			} else {
+				restack.len = strtoul(argv[i], NULL, 10);
+				if (restack.len == 0) {
+					return usage(argv[0]);
+				}
+			}
+		}
+	} else if (argc > 1) {
+		return usage(argv[0]);
+	}
+
 	struct wl_display *display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display\n");
@@ -163,15 +606,21 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	if (pointer != NULL) {
-		wl_pointer_add_listener(pointer, &pointer_listener, NULL);
-	}
-
 	toplevel_init(&toplevel);
 
 	float color[4] = {1, 1, 1, 1};
 	memcpy(toplevel.surface.color, color, sizeof(float[4]));
 
+	if (fanout_mode) {
+		return run_fanout(display);
+	} else if (restack_mode) {
+		return run_restack(display);
+	}
+
+	if (pointer != NULL) {
+		wl_pointer_add_listener(pointer, &pointer_listener, NULL);
+	}
+
 	for (size_t i = 0; i < subsurfaces_len; ++i) {
 		subsurface_init(&subsurfaces[i], toplevel.surface.wl_surface);
 